@@ -2,8 +2,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SINCOS_SIMD        // AVX2 and AVX-512 kernels compiled with target attributes, chosen at run time
+#include <immintrin.h>
+#endif
 
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <string.h>
+#include <stddef.h>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -16,6 +31,12 @@
 #include <GL/glew.h>		// must be downloaded
 #include <GL/freeglut.h>	// must be downloaded unless you have an Apple
 #endif
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 const unsigned int windowWidth = 600, windowHeight = 600;
@@ -23,9 +44,138 @@ const unsigned int windowWidth = 600, windowHeight = 600;
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // You are supposed to modify the code from here...
 
+// The infrastructure below, from the allocation counters to the benchmark harness, has an identical copy in
+// clifford.cpp, the other single-file program: fix both copies together. StreamBuffer, FrameAllocator and the
+// geometry file are only here.
+
 // OpenGL major and minor versions
 int majorVersion = 3, minorVersion = 3;
 
+// number of heap allocations since the start, counted by the replaced global operator new, and their
+// sizes: class c counts the allocations of (2^(c-1), 2^c] bytes
+std::atomic<long> allocationCount(0);
+const int ALLOCATION_SIZE_CLASSES = 48;
+std::atomic<long> allocationSizes[ALLOCATION_SIZE_CLASSES];
+
+int AllocationSizeClass(size_t size) {
+    int c = 0;
+    while (c < ALLOCATION_SIZE_CLASSES - 1 && ((size_t)1 << c) < size) c++;
+    return c;
+}
+
+// kept out of line, so the compiler does not pair the free of an inlined delete with the new of the caller
+#if defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+NOINLINE void * operator new(size_t size) {
+    allocationCount++;
+    allocationSizes[AllocationSizeClass(size)]++;
+    void * p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+NOINLINE void * operator new[](size_t size) { return operator new(size); }
+NOINLINE void operator delete(void * p) noexcept { free(p); }
+NOINLINE void operator delete[](void * p) noexcept { free(p); }
+NOINLINE void operator delete(void * p, size_t) noexcept { free(p); }      // sized forms, so every deallocation matches
+NOINLINE void operator delete[](void * p, size_t) noexcept { free(p); }
+
+// heap allocations of the frames, EndFrame is called at the end of every onDisplay
+struct FrameAllocationCounter {
+    long frameStart;		// allocationCount at the start of the current frame
+    long frames, allocatingFrames, maxPerFrame;
+    long sizesStart[ALLOCATION_SIZE_CLASSES];       // allocationSizes at the start of the current frame
+    long frameSizes[ALLOCATION_SIZE_CLASSES];       // size classes of the last finished frame
+    long maxFrameSizes[ALLOCATION_SIZE_CLASSES];    // size classes of the frame with the most allocations
+
+    FrameAllocationCounter() { Restart(); }
+
+    void Restart() {
+        frameStart = allocationCount;
+        frames = allocatingFrames = maxPerFrame = 0;
+        for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) {
+            sizesStart[c] = allocationSizes[c];
+            frameSizes[c] = maxFrameSizes[c] = 0;
+        }
+    }
+
+    void EndFrame() {
+        long now = allocationCount, allocations = now - frameStart;
+        frameStart = now;
+        for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) {
+            long sizes = allocationSizes[c];
+            frameSizes[c] = sizes - sizesStart[c];
+            sizesStart[c] = sizes;
+        }
+        frames++;
+        if (allocations > 0) allocatingFrames++;
+        if (allocations > maxPerFrame) {
+            maxPerFrame = allocations;
+            for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) maxFrameSizes[c] = frameSizes[c];
+        }
+    }
+};
+
+FrameAllocationCounter frameAllocations;
+
+// a size class histogram as a JSON object, keyed by the upper bound of the class in bytes
+void WriteAllocationSizes(FILE * out, const char * name, const long * sizes) {
+    fprintf(out, "\t\"%s\": {", name);
+    const char * separator = " ";
+    for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) {
+        if (sizes[c] == 0) continue;
+        fprintf(out, "%s\"%llu\": %ld", separator, 1ULL << c, sizes[c]);
+        separator = ", ";
+    }
+    fprintf(out, " },\n");
+}
+
+// Linear allocator for data that lives at most until the end of the frame. Reset at the end of onDisplay
+// frees everything at once, Release frees what was allocated after a Mark. A request that does not fit
+// goes to the heap, and Reset grows the arena to the peak of the frame, so steady frames do not allocate.
+class FrameAllocator {
+    std::vector<char> arena;		// only Reset resizes it, so the pointers stay valid during the frame
+    size_t top, peak;
+    std::vector<void *> overflow;	// heap blocks of the requests that did not fit
+public:
+    FrameAllocator(size_t capacity = 1 << 20) : arena(capacity) { top = peak = 0; }
+
+    // uninitialized memory for n objects of a trivially copyable type, 16 byte aligned
+    template<class T> T * Allocate(size_t n) {
+        size_t start = (top + 15) & ~(size_t)15, end = start + n * sizeof(T);
+        peak = std::max(peak, end);
+        if (end <= arena.size()) {
+            top = end;
+            return (T *)&arena[start];
+        }
+        overflow.push_back(operator new(n * sizeof(T)));
+        return (T *)overflow.back();
+    }
+
+    // Release(Mark()) frees everything allocated after the Mark
+    struct Marker { size_t top, overflowCount; };
+    Marker Mark() const { Marker m = { top, overflow.size() }; return m; }
+    void Release(Marker m) {
+        top = m.top;
+        while (overflow.size() > m.overflowCount) {
+            operator delete(overflow.back());
+            overflow.pop_back();
+        }
+    }
+
+    void Reset() {
+        for (size_t i = 0; i < overflow.size(); i++) operator delete(overflow[i]);
+        overflow.clear();
+        if (peak > arena.size()) std::vector<char>(peak + peak / 2).swap(arena);
+        top = peak = 0;
+    }
+};
+FrameAllocator frameAllocator;
+
+
 void getErrorInfo(unsigned int handle) {
     int logLen;
     glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &logLen);
@@ -34,7 +184,7 @@ void getErrorInfo(unsigned int handle) {
         int written;
         glGetShaderInfoLog(handle, logLen, &written, log);
         printf("Shader log:\n%s", log);
-        delete log;
+        delete[] log;
     }
 }
 
@@ -58,17 +208,105 @@ void checkLinking(unsigned int program) {
     }
 }
 
+// extensions have to be queried one by one in the core profile
+bool ExtensionSupported(const char * name) {
+    int n = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+    for (int i = 0; i < n; i++)
+        if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name) == 0) return true;
+    return false;
+}
+
+// lets the driver compile shaders on its own threads, so that compiling does not block the application
+void EnableParallelShaderCompile() {
+#if !defined(__APPLE__)
+    typedef void (GLAPIENTRY * MaxShaderCompilerThreadsProc)(GLuint count);
+    MaxShaderCompilerThreadsProc maxThreads = NULL;
+    if (ExtensionSupported("GL_KHR_parallel_shader_compile"))
+        maxThreads = (MaxShaderCompilerThreadsProc)glutGetProcAddress("glMaxShaderCompilerThreadsKHR");
+    else if (GLEW_ARB_parallel_shader_compile)
+        maxThreads = glMaxShaderCompilerThreadsARB;
+    if (maxThreads) maxThreads(0xFFFFFFFF);		// as many threads as the implementation likes
+#endif
+}
+
+// Shader program whose compilation and linking are only issued by Create. The driver works on them while
+// the application uploads geometry, and the status is checked when the program is first used.
+class ShaderProgram {
+    unsigned int program, vertexShader, fragmentShader;
+    bool checked;
+
+    static unsigned int CreateShader(GLenum type, const char * source, const char * name) {
+        unsigned int shader = glCreateShader(type);
+        if (!shader) {
+            printf("Error in %s shader creation\n", name);
+            exit(1);
+        }
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        return shader;
+    }
+public:
+    ShaderProgram() { program = vertexShader = fragmentShader = 0; checked = false; }
+
+    unsigned int Create(const char * vertexSource, const char * fragmentSource, const char * fragmentOutput) {
+        vertexShader = CreateShader(GL_VERTEX_SHADER, vertexSource, "vertex");
+        fragmentShader = CreateShader(GL_FRAGMENT_SHADER, fragmentSource, "fragment");
+
+        // Attach shaders to a single program
+        program = glCreateProgram();
+        if (!program) {
+            printf("Error in shader program creation\n");
+            exit(1);
+        }
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+
+        // Connect the fragmentColor to the frame buffer memory
+        glBindFragDataLocation(program, 0, fragmentOutput);	// fragmentColor goes to the frame buffer memory
+
+        glLinkProgram(program);		// program packaging, not waited for
+        checked = false;
+        return program;
+    }
+
+    // makes this program run, the first time it waits for the compilation and reports the errors
+    void Use() {
+        if (!checked) {
+            checkShader(vertexShader, "Vertex shader error");
+            checkShader(fragmentShader, "Fragment shader error");
+            checkLinking(program);
+            glDeleteShader(vertexShader);	// the program keeps them while it exists
+            glDeleteShader(fragmentShader);
+            checked = true;
+        }
+        glUseProgram(program);
+    }
+
+    unsigned int Id() const { return program; }
+};
+
 // vertex shader in GLSL
 const char * vertexSource = R"(
 	#version 330
     precision highp float;
 
 	uniform mat4 MVP;			// View-Projection matrix in row-major format
+	uniform vec2 mobiusA, mobiusB, mobiusC, mobiusD;	// Moebius transformation (a z + b) / (c z + d)
+	uniform vec2 positionScale, positionOffset;			// dequantization of the stored positions
 
 	layout(location = 0) in vec2 vertexPosition;	// Attrib Array 0
+	layout(location = 1) in vec3 vertexColor;		// Attrib Array 1, constant if the object has no colours
+	out vec3 color;									// output attribute
+
+	vec2 cmul(vec2 p, vec2 q) { return vec2(p.x * q.x - p.y * q.y, p.x * q.y + p.y * q.x); }
+	vec2 cdiv(vec2 p, vec2 q) { return vec2(p.x * q.x + p.y * q.y, p.y * q.x - p.x * q.y) / dot(q, q); }
 
 	void main() {
-		gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1) * MVP; 		// transform to clipping space
+		vec2 p = positionOffset + positionScale * vertexPosition;
+		vec2 z = cdiv(cmul(mobiusA, p) + mobiusB, cmul(mobiusC, p) + mobiusD);
+		gl_Position = vec4(z.x, z.y, 0, 1) * MVP; 		// transform to clipping space
+		color = vertexColor;							// copy color from input to output
 	}
 )";
 
@@ -77,31 +315,183 @@ const char * fragmentSource = R"(
 	#version 330
     precision highp float;
 
-	uniform vec3 color;			// uniform color
+	in vec3 color;				// variable input: interpolated color of vertex shader
 	out vec4 fragmentColor;		// output that goes to the raster memory as told by glBindFragDataLocation
 
 	void main() {
-		fragmentColor = vec4(1, 1, 1, 1); // extend RGB to RGBA
+		fragmentColor = vec4(color, 1); // extend RGB to RGBA
 	}
 )";
 
+//---------------------------------------------------------------------------------------------
+// Sine and cosine of the same angle together: Cody-Waite reduction by pi/4 and the minimax
+// polynomials of Cephes sinf/cosf. Error against the double precision result for |x| <= 8192:
+// at most 2 ULP for results above 2^-10 in magnitude, and below 2^-33 absolute error near the zeros.
+// Larger arguments and NaN go to the C library. The AVX2 and AVX-512 versions perform the
+// same operations in the same order on 8 and 16 lanes, so they have the same error bounds
+// (the scalar tail may differ in the last bit if the compiler contracts it to FMA instructions).
+// They are compiled for their instruction sets whatever the build flags are, and the batch
+// function picks the widest one the processor supports when it is first called.
+//---------------------------------------------------------------------------------------------
+const float SINCOS_LIMIT = 8192.0f;
+const float SINCOS_4_PI = 1.27323954473516f;        // 4 / pi
+const float SINCOS_DP1 = 0.78515625f, SINCOS_DP2 = 2.4187564849853515625e-4f, SINCOS_DP3 = 3.77489497744594108e-8f;
+const float SIN_C0 = -1.9515295891e-4f, SIN_C1 = 8.3321608736e-3f, SIN_C2 = -1.6666654611e-1f;
+const float COS_C0 = 2.443315711809948e-5f, COS_C1 = -1.388731625493765e-3f, COS_C2 = 4.166664568298827e-2f;
+
+inline void FastSinCos(float x, float& s, float& c) {
+    float ax = fabsf(x);
+    if (!(ax <= SINCOS_LIMIT)) {
+        s = sinf(x); c = cosf(x);
+        return;
+    }
+    int j = (int)(ax * SINCOS_4_PI);
+    j = (j + 1) & ~1;                                    // octant pair, the angle is reduced to [-pi/4, pi/4]
+    float y = (float)j;
+    float z = ((ax - y * SINCOS_DP1) - y * SINCOS_DP2) - y * SINCOS_DP3;
+    float zz = z * z;
+    float ps = ((SIN_C0 * zz + SIN_C1) * zz + SIN_C2) * zz * z + z;
+    float pc = ((COS_C0 * zz + COS_C1) * zz + COS_C2) * zz * zz - 0.5f * zz + 1.0f;
+    bool swap = (j & 2) != 0;
+    s = swap ? pc : ps;
+    c = swap ? ps : pc;
+    if (((j & 4) != 0) != (x < 0)) s = -s;
+    if ((j + 2) & 4) c = -c;
+}
+
+#if defined(SINCOS_SIMD)
+// zero masked forms where the plain intrinsic passes an undefined source register, which GCC warns about
+#define ALL16 ((__mmask16)0xffff)
+__attribute__((target("avx512f"))) void FastSinCos16(const float * x, float * s, float * c) {
+    __m512 vx = _mm512_loadu_ps(x);
+    __m512i signBit = _mm512_set1_epi32(0x80000000);
+    __m512 ax = _mm512_castsi512_ps(_mm512_and_si512(_mm512_set1_epi32(0x7fffffff), _mm512_castps_si512(vx)));
+    if (_mm512_cmp_ps_mask(ax, _mm512_set1_ps(SINCOS_LIMIT), _CMP_NLE_UQ)) {    // some lanes for the C library
+        for (int i = 0; i < 16; i++) FastSinCos(x[i], s[i], c[i]);
+        return;
+    }
+    __m512i j = _mm512_maskz_cvttps_epi32(ALL16, _mm512_mul_ps(ax, _mm512_set1_ps(SINCOS_4_PI)));
+    j = _mm512_and_si512(_mm512_add_epi32(j, _mm512_set1_epi32(1)), _mm512_set1_epi32(~1));
+    __m512 y = _mm512_maskz_cvtepi32_ps(ALL16, j);
+    __m512 z = _mm512_sub_ps(ax, _mm512_mul_ps(y, _mm512_set1_ps(SINCOS_DP1)));
+    z = _mm512_sub_ps(z, _mm512_mul_ps(y, _mm512_set1_ps(SINCOS_DP2)));
+    z = _mm512_sub_ps(z, _mm512_mul_ps(y, _mm512_set1_ps(SINCOS_DP3)));
+    __m512 zz = _mm512_mul_ps(z, z);
+    __m512 ps = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(SIN_C0), zz), _mm512_set1_ps(SIN_C1));
+    ps = _mm512_add_ps(_mm512_mul_ps(ps, zz), _mm512_set1_ps(SIN_C2));
+    ps = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(ps, zz), z), z);
+    __m512 pc = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(COS_C0), zz), _mm512_set1_ps(COS_C1));
+    pc = _mm512_add_ps(_mm512_mul_ps(pc, zz), _mm512_set1_ps(COS_C2));
+    pc = _mm512_sub_ps(_mm512_mul_ps(_mm512_mul_ps(pc, zz), zz), _mm512_mul_ps(_mm512_set1_ps(0.5f), zz));
+    pc = _mm512_add_ps(pc, _mm512_set1_ps(1.0f));
+    __mmask16 swap = _mm512_test_epi32_mask(j, _mm512_set1_epi32(2));
+    __m512i sv = _mm512_castps_si512(_mm512_mask_blend_ps(swap, ps, pc));
+    __m512i cv = _mm512_castps_si512(_mm512_mask_blend_ps(swap, pc, ps));
+    __m512i sinSign = _mm512_xor_si512(_mm512_maskz_slli_epi32(ALL16, _mm512_and_si512(j, _mm512_set1_epi32(4)), 29),
+                                       _mm512_and_si512(_mm512_castps_si512(vx), signBit));
+    __m512i cosSign = _mm512_maskz_slli_epi32(ALL16, _mm512_and_si512(_mm512_add_epi32(j, _mm512_set1_epi32(2)), _mm512_set1_epi32(4)), 29);
+    _mm512_storeu_ps(s, _mm512_castsi512_ps(_mm512_xor_si512(sv, sinSign)));
+    _mm512_storeu_ps(c, _mm512_castsi512_ps(_mm512_xor_si512(cv, cosSign)));
+}
+
+__attribute__((target("avx2"))) void FastSinCos8(const float * x, float * s, float * c) {
+    __m256 vx = _mm256_loadu_ps(x);
+    __m256 signBit = _mm256_set1_ps(-0.0f);
+    __m256 ax = _mm256_andnot_ps(signBit, vx);
+    if (_mm256_movemask_ps(_mm256_cmp_ps(ax, _mm256_set1_ps(SINCOS_LIMIT), _CMP_NLE_UQ))) {    // some lanes for the C library
+        for (int i = 0; i < 8; i++) FastSinCos(x[i], s[i], c[i]);
+        return;
+    }
+    __m256i j = _mm256_cvttps_epi32(_mm256_mul_ps(ax, _mm256_set1_ps(SINCOS_4_PI)));
+    j = _mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+    __m256 y = _mm256_cvtepi32_ps(j);
+    __m256 z = _mm256_sub_ps(ax, _mm256_mul_ps(y, _mm256_set1_ps(SINCOS_DP1)));
+    z = _mm256_sub_ps(z, _mm256_mul_ps(y, _mm256_set1_ps(SINCOS_DP2)));
+    z = _mm256_sub_ps(z, _mm256_mul_ps(y, _mm256_set1_ps(SINCOS_DP3)));
+    __m256 zz = _mm256_mul_ps(z, z);
+    __m256 ps = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(SIN_C0), zz), _mm256_set1_ps(SIN_C1));
+    ps = _mm256_add_ps(_mm256_mul_ps(ps, zz), _mm256_set1_ps(SIN_C2));
+    ps = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(ps, zz), z), z);
+    __m256 pc = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(COS_C0), zz), _mm256_set1_ps(COS_C1));
+    pc = _mm256_add_ps(_mm256_mul_ps(pc, zz), _mm256_set1_ps(COS_C2));
+    pc = _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(pc, zz), zz), _mm256_mul_ps(_mm256_set1_ps(0.5f), zz));
+    pc = _mm256_add_ps(pc, _mm256_set1_ps(1.0f));
+    __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)), _mm256_set1_epi32(2)));
+    __m256 sv = _mm256_blendv_ps(ps, pc, swap), cv = _mm256_blendv_ps(pc, ps, swap);
+    __m256 sinSign = _mm256_xor_ps(_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(4)), 29)),
+                                   _mm256_and_ps(vx, signBit));
+    __m256 cosSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(2)), _mm256_set1_epi32(4)), 29));
+    _mm256_storeu_ps(s, _mm256_xor_ps(sv, sinSign));
+    _mm256_storeu_ps(c, _mm256_xor_ps(cv, cosSign));
+}
+#endif
+
+// lanes of the widest kernel the processor can run, 1: the scalar one
+int SinCosLanes() {
+#if defined(SINCOS_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return 16;
+    if (__builtin_cpu_supports("avx2")) return 8;
+#endif
+    return 1;
+}
+
+// n angles, the output arrays may be the input array
+void FastSinCos(const float * x, float * s, float * c, int n) {
+    static const int lanes = SinCosLanes();
+    int i = 0;
+#if defined(SINCOS_SIMD)
+    if (lanes == 16) for (; i + 16 <= n; i += 16) FastSinCos16(x + i, s + i, c + i);
+    if (lanes >= 8) for (; i + 8 <= n; i += 8) FastSinCos8(x + i, s + i, c + i);
+#endif
+    for (; i < n; i++) FastSinCos(x[i], s[i], c[i]);
+}
+
+// pack of 4 floats processed together, the loops are mapped to SSE/NEON instructions by the compiler
+struct Pack4 {
+    alignas(16) float v[4];
+    Pack4(float a = 0) { v[0] = v[1] = v[2] = v[3] = a; }
+    Pack4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+    float& operator[](int i) { return v[i]; }
+    float operator[](int i) const { return v[i]; }
+    Pack4& operator+=(const Pack4& r) { for (int i = 0; i < 4; i++) v[i] += r.v[i]; return *this; }
+    Pack4& operator-=(const Pack4& r) { for (int i = 0; i < 4; i++) v[i] -= r.v[i]; return *this; }
+    Pack4& operator*=(const Pack4& r) { for (int i = 0; i < 4; i++) v[i] *= r.v[i]; return *this; }
+    Pack4& operator/=(const Pack4& r) { for (int i = 0; i < 4; i++) v[i] /= r.v[i]; return *this; }
+};
+
+inline Pack4 operator+(Pack4 l, const Pack4& r) { return l += r; }
+inline Pack4 operator-(Pack4 l, const Pack4& r) { return l -= r; }
+inline Pack4 operator*(Pack4 l, const Pack4& r) { return l *= r; }
+inline Pack4 operator/(Pack4 l, const Pack4& r) { return l /= r; }
+inline Pack4 operator-(const Pack4& a) { return Pack4(-a.v[0], -a.v[1], -a.v[2], -a.v[3]); }
+inline Pack4 sin(const Pack4& a) { Pack4 s, c; FastSinCos(a.v, s.v, c.v, 4); return s; }
+inline Pack4 cos(const Pack4& a) { Pack4 s, c; FastSinCos(a.v, s.v, c.v, 4); return c; }
+inline Pack4 sqrt(const Pack4& a) { return Pack4(sqrtf(a.v[0]), sqrtf(a.v[1]), sqrtf(a.v[2]), sqrtf(a.v[3])); }
+
+// The math types are templates of the scalar type (float, double or Pack4),
+// the names without T are the float versions used for the GPU
+
 // row-major matrix 4x4
-struct mat4 {
-    float m[4][4];
+template<class T> struct mat4T {
+    T m[4][4];
 public:
-    mat4() {}
-    mat4(float m00, float m01, float m02, float m03,
-         float m10, float m11, float m12, float m13,
-         float m20, float m21, float m22, float m23,
-         float m30, float m31, float m32, float m33) {
+    mat4T() {}
+    mat4T(T m00, T m01, T m02, T m03,
+          T m10, T m11, T m12, T m13,
+          T m20, T m21, T m22, T m23,
+          T m30, T m31, T m32, T m33) {
         m[0][0] = m00; m[0][1] = m01; m[0][2] = m02; m[0][3] = m03;
         m[1][0] = m10; m[1][1] = m11; m[1][2] = m12; m[1][3] = m13;
         m[2][0] = m20; m[2][1] = m21; m[2][2] = m22; m[2][3] = m23;
         m[3][0] = m30; m[3][1] = m31; m[3][2] = m32; m[3][3] = m33;
     }
+    template<class U> explicit mat4T(const mat4T<U>& r) {   // change of precision
+        for (int i = 0; i < 4; i++) for (int j = 0; j < 4; j++) m[i][j] = r.m[i][j];
+    }
 
-    mat4 operator*(const mat4& right) {
-        mat4 result;
+    mat4T operator*(const mat4T& right) {
+        mat4T result;
         for (int i = 0; i < 4; i++) {
             for (int j = 0; j < 4; j++) {
                 result.m[i][j] = 0;
@@ -110,20 +500,22 @@ public:
         }
         return result;
     }
-    operator float*() { return &m[0][0]; }
+    operator T*() { return &m[0][0]; }
 };
 
+typedef mat4T<float> mat4;
 
 // 3D point in homogeneous coordinates
-struct vec4 {
-    float v[4];
+template<class T> struct vec4T {
+    T v[4];
 
-    vec4(float x = 0, float y = 0, float z = 0, float w = 1) {
+    vec4T(T x = 0, T y = 0, T z = 0, T w = 1) {
         v[0] = x; v[1] = y; v[2] = z; v[3] = w;
     }
+    template<class U> explicit vec4T(const vec4T<U>& r) { for (int i = 0; i < 4; i++) v[i] = r.v[i]; }
 
-    vec4 operator*(const mat4& mat) {
-        vec4 result;
+    vec4T operator*(const mat4T<T>& mat) {
+        vec4T result;
         for (int j = 0; j < 4; j++) {
             result.v[j] = 0;
             for (int i = 0; i < 4; i++) result.v[j] += v[i] * mat.m[i][j];
@@ -132,6 +524,8 @@ struct vec4 {
     }
 };
 
+typedef vec4T<float> vec4;
+
 // 2D camera
 struct Camera {
     float wCx, wCy;	// center in world coordinates
@@ -181,33 +575,88 @@ public:
 Camera camera;
 
 // handle of the shader program
+ShaderProgram gpuProgram;
 unsigned int shaderProgram;
 
-struct Complex {
-    float x, y;
-    Complex(float x0 = 0, float y0 = 0) { x = x0, y = y0; }
-    Complex operator+(Complex r) { return Complex(x + r.x, y + r.y); }
-    Complex operator-(Complex r) { return Complex(x - r.x, y - r.y); }
-    Complex operator*(Complex r) {
-        return Complex(x * r.x - y * r.y, x * r.y + y * r.x);
+template<class T> struct ComplexT {
+    T x, y;
+    ComplexT(T x0 = 0, T y0 = 0) { x = x0, y = y0; }
+    template<class U> explicit ComplexT(const ComplexT<U>& r) { x = r.x; y = r.y; }   // change of precision
+    ComplexT operator+(ComplexT r) const { return ComplexT(x + r.x, y + r.y); }
+    ComplexT operator-(ComplexT r) const { return ComplexT(x - r.x, y - r.y); }
+    ComplexT operator*(ComplexT r) const {
+        return ComplexT(x * r.x - y * r.y, x * r.y + y * r.x);
     }
-    Complex operator/(Complex r) {
-        float l = r.x * r.x + r.y * r.y;
-        return (*this) * Complex(r.x / l, -r.y / l);
+    ComplexT operator/(ComplexT r) const {
+        T l = r.x * r.x + r.y * r.y;
+        return (*this) * ComplexT(r.x / l, -r.y / l);
     }
 };
 
+typedef ComplexT<float> Complex;
+
+template<class T> ComplexT<T> Polar(T r, T phi) {
+    return ComplexT<T>(r * cos(phi), r * sin(phi));
+}
+
 Complex Polar(float r, float phi) {
-    return Complex(r * cos(phi), r * sin(phi));
+    float s, c;
+    FastSinCos(phi, s, c);
+    return Complex(r * c, r * s);
 }
 
+// n complex numbers from polar coordinates with the vectorized kernel
+void Polar(const float * r, const float * phi, Complex * out, int n) {
+    const int CHUNK = 64;
+    float s[CHUNK], c[CHUNK];
+    for (int base = 0; base < n; base += CHUNK) {
+        int m = std::min(CHUNK, n - base);
+        FastSinCos(phi + base, s, c, m);
+        for (int i = 0; i < m; i++) out[base + i] = Complex(r[base + i] * c[i], r[base + i] * s[i]);
+    }
+}
+
+// Moebius transformation z -> (a z + b) / (c z + d) as the 2x2 complex matrix [a b; c d],
+// so a chain of transformations composes to a single one by matrix products
+template<class T> struct MobiusT {
+    ComplexT<T> a, b, c, d;
+    MobiusT(ComplexT<T> a0 = 1, ComplexT<T> b0 = 0, ComplexT<T> c0 = 0, ComplexT<T> d0 = 1) { a = a0; b = b0; c = c0; d = d0; }
+    template<class U> explicit MobiusT(const MobiusT<U>& m) : a(m.a), b(m.b), c(m.c), d(m.d) { }
+
+    static MobiusT Translate(ComplexT<T> v) { return MobiusT(1, v, 0, 1); }
+    static MobiusT Multiply(ComplexT<T> s) { return MobiusT(s, 0, 0, 1); }  // rotation and scaling around the origin
+    static MobiusT Inversion() { return MobiusT(0, 1, 1, 0); }              // 1 / z
+
+    // composition: (*this)(r(z)), r is applied first
+    MobiusT operator*(const MobiusT& r) const {
+        return MobiusT(a * r.a + b * r.c, a * r.b + b * r.d,
+                       c * r.a + d * r.c, c * r.b + d * r.d);
+    }
+
+    ComplexT<T> operator()(ComplexT<T> z) const { return (a * z + b) / (c * z + d); }
+
+    // batched application: a complex multiply-add per point for similarities, plus a division otherwise;
+    // a scalar loop the compiler vectorizes, in the precision of T
+    void Apply(const ComplexT<T> * in, ComplexT<T> * out, int n) const {
+        if (c.x == 0 && c.y == 0) {     // similarity transformations need no division
+            ComplexT<T> s = a / d, v = b / d;
+            for (int i = 0; i < n; i++) out[i] = s * in[i] + v;
+        } else {
+            for (int i = 0; i < n; i++) out[i] = (*this)(in[i]);
+        }
+    }
+};
+
+typedef MobiusT<float> Mobius;
+
+
 
 class PureObject {
     unsigned int vao;
     unsigned int vbo;
     std::vector<vec4> vertexs;
 public:
-    PureObject(std::vector<vec4> vertexs) :vertexs(vertexs){
+    PureObject(const std::vector<vec4>& vertexs) :vertexs(vertexs){
 
         glGenVertexArrays(1, &vao);	// create 1 vertex array object
         glBindVertexArray(vao);		// make it active
@@ -236,42 +685,845 @@ public:
 
 };
 
+//---------------------------------------------------------------------------------------------
+// Time base: nanoseconds of a monotonic clock in 64 bit integers, fixed simulation steps and frame intervals
+//---------------------------------------------------------------------------------------------
+// Times are kept as integers and converted to seconds only as short differences or after reducing them
+// by a period, so a run of weeks animates as smoothly as the first minute.
+typedef long long Nanoseconds;
+const Nanoseconds NANOSECONDS_PER_SECOND = 1000000000LL;
+
+const std::chrono::steady_clock::time_point programStart = std::chrono::steady_clock::now();
+
+// nsec since the start of the program, never goes backwards
+Nanoseconds MonotonicTime() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - programStart).count();
+}
+
+// Fixed-step simulation at a variable frame rate: Advance gives the number of steps that bring the simulated
+// time up to now, and Alpha where now is after the last step. A frame shows the state interpolated between
+// the last two steps, i.e. it is one step behind, but the motion does not depend on the frame intervals.
+class FixedStep {
+    Nanoseconds dt, maxLag;         // length of a step, lag skipped instead of caught up with
+    Nanoseconds simulated;          // time of the last step
+    bool synced;
+    long skipped;                   // times the simulation has fallen behind by more than maxLag
+public:
+    FixedStep(Nanoseconds dt0, Nanoseconds maxLag0) { dt = dt0; maxLag = maxLag0; simulated = 0; synced = false; skipped = 0; }
+
+    double Dt() const { return (double)dt / NANOSECONDS_PER_SECOND; }           // sec
+    double Seconds() const { return (double)simulated / NANOSECONDS_PER_SECOND; }   // time of the last step
+    long Skipped() const { return skipped; }
+    void Unsync() { synced = false; }
+
+    // steps to do, or -1 if the state has to be set directly for Seconds(): at the start and after a stall
+    int Advance(Nanoseconds now) {
+        if (!synced || now - simulated > maxLag) {
+            if (synced) skipped++;
+            simulated = now - now % dt;
+            synced = true;
+            return -1;
+        }
+        int n = now > simulated ? (int)((now - simulated) / dt) : 0;
+        simulated += n * dt;
+        return n;
+    }
+
+    // 0: the frame shows the state of the step before the last one, 1: the state of the last step
+    float Alpha(Nanoseconds now) const {
+        float alpha = (float)(now - simulated) / dt;
+        return alpha < 0 ? 0 : (alpha > 1 ? 1 : alpha);
+    }
+};
+
+// statistics of the intervals between frames without storing them: Welford's running mean and variance
+class FrameIntervals {
+    Nanoseconds last, shortest, longest;
+    long count;
+    double mean, m2;                // msec, m2: sum of the squared deviations from the mean
+public:
+    FrameIntervals() { last = -1; shortest = longest = 0; count = 0; mean = m2 = 0; }
+
+    void Add(Nanoseconds now) {
+        if (last >= 0) {
+            Nanoseconds delta = now - last;
+            if (count == 0 || delta < shortest) shortest = delta;
+            if (count == 0 || delta > longest) longest = delta;
+            double ms = delta / 1e6;
+            count++;
+            double d = ms - mean;
+            mean += d / count;
+            m2 += d * (ms - mean);
+        }
+        last = now;
+    }
+
+    long Count() const { return count; }
+    double MeanMs() const { return mean; }
+    double DeviationMs() const { return count > 1 ? sqrt(m2 / (count - 1)) : 0; }
+    double ShortestMs() const { return shortest / 1e6; }
+    double LongestMs() const { return longest / 1e6; }
+
+    void Print() const {
+        if (count > 0) printf("Frame intervals: %.3f ms mean, %.3f ms deviation, %.3f - %.3f ms in %ld frames\n",
+            MeanMs(), DeviationMs(), ShortestMs(), LongestMs(), count);
+    }
+};
+
+FrameIntervals frameIntervals;
+
+// transformation of the points by the vertex shader instead of the CPU, toggled with g
+bool mobiusOnGpu = false;
+
+// incremental animation with fixed time steps instead of recomputing the state from the time, toggled with i
+bool incrementalAnimation = true;
+const Nanoseconds animationStep = NANOSECONDS_PER_SECOND / 120;   // time step of the incremental animation
+const double animationDt = (double)animationStep / NANOSECONDS_PER_SECOND;
+FixedStep animationSteps(animationStep, NANOSECONDS_PER_SECOND / 4);  // too far behind to catch up after 0.25 sec
+
+// scale * e^(i omega t) at a uniform angular velocity, advanced by multiplying with the constant
+// step rotor Polar(1, omega dt) instead of evaluating sine and cosine in every step
+struct Rotor {
+    static const int RENORMALIZE = 64;  // steps between restoring the length lost to rounding
+    static const int RESYNC = 4096;     // steps between recomputing the exact angle, bounds the phase drift
+    float scale, omega;
+    double dt;
+    float angle0;                       // angle at the last Reset
+    long steps;                         // steps since the last Reset
+    Complex r, step;
+    Complex previous;                   // state one step before r
+
+    Rotor(float scale0, float omega0, double dt0) {
+        scale = scale0; omega = omega0; dt = dt0;
+        step = Polar(1, (float)(omega * dt));
+        Reset(0);
+    }
+
+    void Reset(double t) {              // exact state at time t, the angle is reduced in double as t can be large
+        angle0 = (float)fmod(omega * t, 2 * M_PI);
+        steps = 0;
+        r = previous = Polar(scale, angle0);
+    }
+
+    void Advance() {
+        previous = r;
+        steps++;
+        if (steps % RESYNC == 0) {
+            r = Polar(scale, (float)fmod(angle0 + (double)omega * dt * steps, 2 * M_PI));   // reduced in double, steps can be large
+        } else {
+            r = r * step;
+            if (steps % RENORMALIZE == 0) {
+                float l = sqrtf(r.x * r.x + r.y * r.y);
+                r = r * Complex(scale / l, 0);
+            }
+        }
+    }
+
+    // between previous (alpha 0) and r (alpha 1): a step is a short arc, so the normalized chord is close enough
+    Complex At(float alpha) const {
+        if (alpha >= 1) return r;
+        Complex p = previous + (r - previous) * Complex(alpha, 0);
+        float l = sqrtf(p.x * p.x + p.y * p.y);
+        return l > 0 ? p * Complex(scale / l, 0) : r;
+    }
+};
+
+//---------------------------------------------------------------------------------------------
+// Persistent worker threads: ParallelFor splits [0, n) into chunks taken by the workers and
+// the calling thread, and returns when all chunks are done
+//---------------------------------------------------------------------------------------------
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start, done;
+    void (*job)(const void *, int, int);     // calls the body of the current ParallelFor
+    const void * body;
+    int n, chunk, busy, generation;
+    std::atomic<int> next;
+    bool quit;
+
+    void Work() {
+        for (int begin = next.fetch_add(chunk); begin < n; begin = next.fetch_add(chunk)) job(body, begin, std::min(begin + chunk, n));
+    }
+
+    void Worker() {
+        int seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!quit && generation == seen) start.wait(lock);
+                if (quit) return;
+                seen = generation;
+            }
+            Work();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+
+public:
+    ThreadPool() : job(NULL), body(NULL), n(0), chunk(1), busy(0), generation(0), next(0), quit(false) { }
+
+    void Start(int nThreads) {
+        for (int i = 0; i < nThreads; i++) workers.push_back(std::thread(&ThreadPool::Worker, this));
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        start.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    }
+
+    int Threads() const { return workers.size() + 1; }
+
+    template<class F> static void Call(const void * body, int begin, int end) { (*(const F *)body)(begin, end); }
+
+    // body(begin, end) for the chunks; a template rather than std::function, so no lambda is copied to the heap
+    template<class F> void ParallelFor(int n0, int chunk0, const F& body0) {
+        if (workers.empty() || n0 <= chunk0) {	// not worth waking up the workers
+            for (int begin = 0; begin < n0; begin += chunk0) body0(begin, std::min(begin + chunk0, n0));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &Call<F>; body = &body0; n = n0; chunk = chunk0;
+            next = 0;
+            busy = workers.size();
+            generation++;
+        }
+        start.notify_all();
+        Work();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (busy > 0) done.wait(lock);
+    }
+};
+
+ThreadPool threadPool;
+
+//---------------------------------------------------------------------------------------------
+// Binary geometry file, mapped into memory and used in place: a header, vertexCount packed
+// positions (2 floats) and optionally vertexCount packed RGB colours (3 floats)
+//---------------------------------------------------------------------------------------------
+struct GeometryHeader {
+    char magic[4];                  // "GEOM"
+    unsigned int version;           // 1
+    unsigned long long vertexCount;
+    unsigned long long positionOffset, colorOffset;   // bytes from the start of the file, colorOffset is 0 without colours
+};
+
+// read-only view of a whole file, pages are loaded on demand by the operating system
+class MappedFile {
+    const char * data;
+    size_t size;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+    HANDLE file, mapping;
+#endif
+public:
+    MappedFile() { data = NULL; size = 0; }
+    ~MappedFile() { Close(); }
+
+    const char * Data() const { return data; }
+    size_t Size() const { return size; }
+
+    bool Open(const char * fileName) {
+        Close();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+        file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        size = (size_t)fileSize.QuadPart;
+        mapping = size > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        if (mapping) data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data) {
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file);
+            return false;
+        }
+#else
+        int file = open(fileName, O_RDONLY);
+        if (file < 0) return false;
+        struct stat status;
+        if (fstat(file, &status) == 0 && status.st_size > 0) {
+            size = status.st_size;
+            void * p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (p != MAP_FAILED) {
+                data = (const char *)p;
+                madvise(p, size, MADV_SEQUENTIAL);     // read ahead, the upload goes from front to back
+            }
+        }
+        close(file);                    // the mapping keeps the file open
+        if (!data) return false;
+#endif
+        return true;
+    }
+
+    void Close() {
+        if (!data) return;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        munmap((void *)data, size);
+#endif
+        data = NULL;
+        size = 0;
+    }
+};
+
+class GeometryFile {
+    MappedFile file;
+public:
+    const Complex * positions;
+    const float * colors;           // NULL if the file has no colours
+    int count;
+
+    GeometryFile() { positions = NULL; colors = NULL; count = 0; }
+
+    bool Open(const char * fileName) {
+        if (!file.Open(fileName)) {
+            printf("Cannot map geometry file %s\n", fileName);
+            return false;
+        }
+        const GeometryHeader * header = (const GeometryHeader *)file.Data();
+        size_t size = file.Size();
+        bool ok = size >= sizeof(GeometryHeader) && memcmp(header->magic, "GEOM", 4) == 0 && header->version == 1 &&
+                  header->vertexCount > 0 && header->vertexCount < (1u << 31) &&
+                  header->positionOffset % 4 == 0 && header->colorOffset % 4 == 0 &&
+                  header->positionOffset <= size && (size - header->positionOffset) / sizeof(Complex) >= header->vertexCount &&
+                  (header->colorOffset == 0 ||
+                   (header->colorOffset <= size && (size - header->colorOffset) / (3 * sizeof(float)) >= header->vertexCount));
+        if (!ok) {
+            printf("%s is not a valid geometry file\n", fileName);
+            file.Close();
+            return false;
+        }
+        count = (int)header->vertexCount;
+        positions = (const Complex *)(file.Data() + header->positionOffset);
+        colors = header->colorOffset ? (const float *)(file.Data() + header->colorOffset) : NULL;
+        return true;
+    }
+
+    static bool Write(const char * fileName, const std::vector<Complex>& positions, const std::vector<float>& colors) {
+        FILE * out = fopen(fileName, "wb");
+        if (!out) {
+            printf("Cannot write %s\n", fileName);
+            return false;
+        }
+        GeometryHeader header;
+        memcpy(header.magic, "GEOM", 4);
+        header.version = 1;
+        header.vertexCount = positions.size();
+        header.positionOffset = sizeof(header);
+        header.colorOffset = colors.empty() ? 0 : sizeof(header) + positions.size() * sizeof(Complex);
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(&positions[0], sizeof(Complex), positions.size(), out);
+        if (!colors.empty()) fwrite(&colors[0], sizeof(float), colors.size(), out);
+        fclose(out);
+        return true;
+    }
+};
+
+// Copies a large array, e.g. from a mapped file, into a buffer in bounded pieces, so that neither the
+// driver nor the application needs a staging copy of the whole array at once.
+void UploadInChunks(unsigned int vbo, const void * data, size_t bytes) {
+    const size_t CHUNK = 16 << 20;
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STATIC_DRAW);
+    for (size_t offset = 0; offset < bytes; offset += CHUNK)
+        glBufferSubData(GL_ARRAY_BUFFER, offset, std::min(CHUNK, bytes - offset), (const char *)data + offset);
+}
+
+//---------------------------------------------------------------------------------------------
+// Compact vertex formats for static geometry: positions as 16 bit fixed point or half floats
+// (4 bytes instead of 8), colours as normalized bytes (4 bytes instead of 12)
+//---------------------------------------------------------------------------------------------
+enum PositionFormat { POSITION_FLOAT, POSITION_HALF, POSITION_FIXED16 };
+PositionFormat staticPositionFormat = POSITION_FIXED16;    // set on the command line
+
+// IEEE 754 half precision, rounded to nearest even, too large values become infinity
+unsigned short FloatToHalf(float f) {
+    unsigned int x;
+    memcpy(&x, &f, 4);
+    unsigned int sign = (x >> 16) & 0x8000, mantissa = x & 0x7fffff;
+    int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+    if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);   // infinity or NaN
+    if (exponent >= 31) return sign | 0x7c00;
+    if (exponent <= 0) {            // subnormal half
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        unsigned int half = mantissa >> shift, rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return sign | half;
+    }
+    unsigned int half = sign | (exponent << 10) | (mantissa >> 13), rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;   // a carry into the exponent is still correct
+    return half;
+}
+
+// the vertex shader computes offset + scale * stored position, stored fixed point values are in [-1, 1]
+struct PositionQuantization {
+    Complex scale, offset;
+    PositionQuantization() : scale(1, 1), offset(0, 0) { }
+};
+
+// the fixed point grid covers the bounding box of the points, the other formats need no scaling
+PositionQuantization FitPositions(const Complex * p, int n, PositionFormat format) {
+    PositionQuantization q;
+    if (format != POSITION_FIXED16 || n == 0) return q;
+    Complex lo = p[0], hi = p[0];
+    for (int i = 1; i < n; i++) {
+        lo = Complex(std::min(lo.x, p[i].x), std::min(lo.y, p[i].y));
+        hi = Complex(std::max(hi.x, p[i].x), std::max(hi.y, p[i].y));
+    }
+    q.offset = Complex((lo.x + hi.x) / 2, (lo.y + hi.y) / 2);
+    q.scale = Complex(std::max((hi.x - lo.x) / 2, 1e-20f), std::max((hi.y - lo.y) / 2, 1e-20f));
+    return q;
+}
+
+//---------------------------------------------------------------------------------------------
+// Interleaved vertex layouts: all attributes of a vertex in one struct and one buffer, the
+// attribute pointers are generated from a static description of the struct
+//---------------------------------------------------------------------------------------------
+struct Half2 { unsigned short x, y; };   // half float pair
+struct Fixed2 { short x, y; };           // 16 bit fixed point pair, normalized to [-1, 1]
+struct Color8 { unsigned char r, g, b, a; };
+
+// components, component type and normalization of an attribute of type T
+template<class T> struct AttributeType;
+template<> struct AttributeType<Complex> { enum { components = 2, type = GL_FLOAT, normalized = GL_FALSE }; };
+template<> struct AttributeType<Half2> { enum { components = 2, type = GL_HALF_FLOAT, normalized = GL_FALSE }; };
+template<> struct AttributeType<Fixed2> { enum { components = 2, type = GL_SHORT, normalized = GL_TRUE }; };
+template<> struct AttributeType<Color8> { enum { components = 4, type = GL_UNSIGNED_BYTE, normalized = GL_TRUE }; };
+
+struct VertexAttribute {
+    unsigned int location;
+    int components;
+    GLenum type;
+    GLboolean normalized;
+    size_t offset;          // in the vertex struct
+};
+
+// the description of a member of a vertex struct bound to a shader input location
+#define VERTEX_ATTRIBUTE(Vertex, member, location) \
+    { location, AttributeType<decltype(Vertex::member)>::components, AttributeType<decltype(Vertex::member)>::type, \
+      (GLboolean)AttributeType<decltype(Vertex::member)>::normalized, offsetof(Vertex, member) }
+
+// the attributes of the bound vao from the bound array buffer, the stride is the size of the struct
+template<class Vertex, int N> void SetVertexLayout(const VertexAttribute (&attributes)[N]) {
+    for (int i = 0; i < N; i++) {
+        glEnableVertexAttribArray(attributes[i].location);
+        glVertexAttribPointer(attributes[i].location, attributes[i].components, attributes[i].type,
+                              attributes[i].normalized, sizeof(Vertex), (const void *)attributes[i].offset);
+    }
+}
+
+// untransformed point and colour of a static object, P is Complex, Half2 or Fixed2
+template<class P> struct StaticVertex {
+    P position;
+    Color8 color;
+
+    static void Layout() {
+        static const VertexAttribute attributes[] = {
+            VERTEX_ATTRIBUTE(StaticVertex, position, 0),
+            VERTEX_ATTRIBUTE(StaticVertex, color, 1)
+        };
+        SetVertexLayout<StaticVertex>(attributes);
+    }
+};
+
+void EncodePosition(Complex p, const PositionQuantization&, Complex& out) { out = p; }
+void EncodePosition(Complex p, const PositionQuantization&, Half2& out) { out.x = FloatToHalf(p.x); out.y = FloatToHalf(p.y); }
+void EncodePosition(Complex p, const PositionQuantization& q, Fixed2& out) {
+    out.x = (short)lrintf((p.x - q.offset.x) / q.scale.x * 32767);
+    out.y = (short)lrintf((p.y - q.offset.y) / q.scale.y * 32767);
+}
+
+unsigned char EncodeColorComponent(float c) { return (unsigned char)lrintf(std::min(std::max(c, 0.0f), 1.0f) * 255); }
+
+// Fills a buffer of n vertices converted piece by piece, encode(first, count, out) converts one piece,
+// so a mapped file is never converted as a whole in memory.
+template<class Vertex, class F> void UploadVertices(unsigned int vbo, int n, F encode) {
+    const int CHUNK = 1 << 20;     // vertices
+    std::vector<Vertex> piece(std::min(n, CHUNK));
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)n * sizeof(Vertex), NULL, GL_STATIC_DRAW);
+    for (int first = 0; first < n; first += CHUNK) {
+        int m = std::min(CHUNK, n - first);
+        encode(first, m, &piece[0]);
+        glBufferSubData(GL_ARRAY_BUFFER, (size_t)first * sizeof(Vertex), (size_t)m * sizeof(Vertex), &piece[0]);
+    }
+}
+
+// Uploads the points and the RGB float colours (white if NULL) to vbo as StaticVertex<P>.
+template<class P> void UploadStaticVertices(unsigned int vbo, const Complex * points, const float * colors, int n,
+                                            const PositionQuantization& q) {
+    UploadVertices<StaticVertex<P> >(vbo, n, [points, colors, &q](int first, int m, StaticVertex<P> * out) {
+        for (int i = 0; i < m; i++) {
+            EncodePosition(points[first + i], q, out[i].position);
+            const float * c = colors ? colors + 3 * (first + i) : NULL;
+            out[i].color.r = c ? EncodeColorComponent(c[0]) : 255;
+            out[i].color.g = c ? EncodeColorComponent(c[1]) : 255;
+            out[i].color.b = c ? EncodeColorComponent(c[2]) : 255;
+            out[i].color.a = 255;
+        }
+    });
+}
+
+//---------------------------------------------------------------------------------------------
+// Streaming of the vertex data written by the CPU every frame. The ways of updating a dynamic
+// buffer differ a lot between drivers, so they are measured: -uploadbench file.json compares them
+// for several sizes, and at startup the fastest one for the size of the objects is chosen.
+//---------------------------------------------------------------------------------------------
+enum UploadStrategy {
+    UPLOAD_BUFFER_DATA,         // glBufferData with the data, the driver reallocates or copies
+    UPLOAD_ORPHAN,              // glBufferData with NULL, then glBufferSubData into the new storage
+    UPLOAD_SUB_DATA,            // glBufferSubData into the same storage
+    UPLOAD_MAP_INVALIDATE,      // glMapBufferRange invalidating the whole buffer
+    UPLOAD_MAP_UNSYNCHRONIZED,  // glMapBufferRange of the next part of a ring, fenced by the application
+    UPLOAD_PERSISTENT,          // ring in a buffer that stays mapped, needs OpenGL 4.4 or ARB_buffer_storage
+    UPLOAD_STRATEGIES
+};
+const char * uploadStrategyNames[UPLOAD_STRATEGIES] = {
+    "bufferdata", "orphan", "subdata", "mapinvalidate", "mapunsynchronized", "persistent"
+};
+int uploadStrategy = -1;       // UploadStrategy, -1: measured at startup, set on the command line
+const char * uploadBenchmarkFile = NULL;
+
+bool UploadStrategySupported(UploadStrategy strategy) {
+    if (strategy != UPLOAD_PERSISTENT) return true;
+#if defined(__APPLE__)
+    return false;
+#else
+    return majorVersion > 4 || (majorVersion == 4 && minorVersion >= 4) || ExtensionSupported("GL_ARB_buffer_storage");
+#endif
+}
+
+class StreamBuffer {
+    static const int SEGMENTS = 3;  // parts of the ring: frames the GPU may still be reading
+    UploadStrategy strategy;
+    unsigned int vbo;
+    size_t capacity;                // bytes of the buffer, of a segment for the rings
+    int segment;                    // of the ring written last
+    GLsync fences[SEGMENTS];        // set when the segment was last drawn
+    char * persistent;              // mapping of the whole persistent buffer
+    char * staging;                 // the mapping written by the caller, NULL for the copying strategies
+    FrameAllocator::Marker mark;    // of the frame allocator memory of the copying strategies
+    size_t offset, bytes;           // of the data written last
+
+    void Wait(int s) {
+        if (!fences[s]) return;
+        while (glClientWaitSync(fences[s], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fences[s]);
+        fences[s] = 0;
+    }
+
+    // storage for at least n bytes, the old content is lost
+    void Reserve(size_t n) {
+        if (n <= capacity) return;
+        for (int s = 0; s < SEGMENTS; s++) Wait(s);
+        capacity = (n + n / 2 + 255) & ~(size_t)255;   // the segments start at aligned offsets
+        if (strategy == UPLOAD_PERSISTENT) {
+#if !defined(__APPLE__)
+            glDeleteBuffers(1, &vbo);       // the storage of a buffer is immutable, it needs a new one
+            glGenBuffers(1, &vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, SEGMENTS * capacity, NULL, flags | GL_DYNAMIC_STORAGE_BIT);
+            persistent = (char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, SEGMENTS * capacity, flags);
+#endif
+        } else {
+            glBufferData(GL_ARRAY_BUFFER, (strategy == UPLOAD_MAP_UNSYNCHRONIZED ? SEGMENTS : 1) * capacity, NULL, GL_STREAM_DRAW);
+        }
+    }
+public:
+    StreamBuffer() {
+        vbo = 0;
+        capacity = offset = bytes = 0;
+        segment = 0;
+        for (int s = 0; s < SEGMENTS; s++) fences[s] = 0;
+        persistent = staging = NULL;
+    }
+
+    void Create(UploadStrategy strategy0) {
+        strategy = strategy0;
+        glGenBuffers(1, &vbo);
+    }
+
+    void Destroy() {
+        for (int s = 0; s < SEGMENTS; s++) Wait(s);
+        glDeleteBuffers(1, &vbo);       // also unmaps the persistent buffer
+        vbo = 0;
+        capacity = 0;
+        persistent = NULL;
+    }
+
+    unsigned int Vbo() const { return vbo; }
+    size_t Offset() const { return offset; }   // of the data in Vbo for the attribute pointer
+
+    // memory for n bytes of new data, the buffer is bound when it returns, the data goes to the GPU in End
+    void * Begin(size_t n) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        bytes = n;
+        offset = 0;
+        staging = NULL;
+        switch (strategy) {
+        case UPLOAD_MAP_INVALIDATE:
+            Reserve(n);
+            staging = (char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, n, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            break;
+        case UPLOAD_MAP_UNSYNCHRONIZED:
+        case UPLOAD_PERSISTENT:
+            Reserve(n);
+            segment = (segment + 1) % SEGMENTS;
+            Wait(segment);                  // the GPU has finished drawing the previous content
+            offset = segment * capacity;
+            if (strategy == UPLOAD_PERSISTENT) staging = persistent ? persistent + offset : NULL;
+            else staging = (char *)glMapBufferRange(GL_ARRAY_BUFFER, offset, n, GL_MAP_WRITE_BIT |
+                                                    GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+            break;
+        default:
+            break;
+        }
+        if (!staging) {                     // the copying strategies, or a mapping failed
+            mark = frameAllocator.Mark();
+            return frameAllocator.Allocate<char>(n);
+        }
+        return staging;
+    }
+
+    void End(const void * data) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        if (data == staging) {
+            if (strategy != UPLOAD_PERSISTENT) glUnmapBuffer(GL_ARRAY_BUFFER);   // coherent mappings need nothing
+            return;
+        }
+        switch (strategy) {
+        case UPLOAD_BUFFER_DATA:
+            glBufferData(GL_ARRAY_BUFFER, bytes, data, GL_STREAM_DRAW);
+            break;
+        case UPLOAD_ORPHAN:
+            glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+            break;
+        default:                            // subdata, or the fallback of a failed mapping
+            if (strategy == UPLOAD_SUB_DATA) Reserve(bytes);
+            glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, data);
+            break;
+        }
+        frameAllocator.Release(mark);
+    }
+
+    // after the commands reading the data written last, the rings do not overwrite it until they are done
+    void Drawn() {
+        if (strategy != UPLOAD_MAP_UNSYNCHRONIZED && strategy != UPLOAD_PERSISTENT) return;
+        if (fences[segment]) glDeleteSync(fences[segment]);
+        fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+};
+
+// milliseconds of an upload of the given size, averaged over iterations after a warm-up
+double MeasureUploads(UploadStrategy strategy, size_t bytes, int iterations) {
+    const int warmUp = 3;
+    StreamBuffer stream;
+    stream.Create(strategy);
+    unsigned int sink;              // a copy on the GPU reads every upload, like the draw of the frame
+    glGenBuffers(1, &sink);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, sink);
+    glBufferData(GL_COPY_WRITE_BUFFER, 16, NULL, GL_STREAM_COPY);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < warmUp + iterations; i++) {
+        if (i == warmUp) {
+            glFinish();
+            start = std::chrono::steady_clock::now();
+        }
+        float * data = (float *)stream.Begin(bytes);
+        for (size_t j = 0; j < bytes / sizeof(float); j++) data[j] = (float)(i + j);
+        stream.End(data);
+        glBindBuffer(GL_COPY_READ_BUFFER, stream.Vbo());
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, stream.Offset() + bytes - 16, 0, 16);
+        stream.Drawn();
+        frameAllocator.Reset();     // as at the end of a frame
+    }
+    glFinish();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+    stream.Destroy();
+    glDeleteBuffers(1, &sink);
+    return ms;
+}
+
+// larger buffers are ranked by a probe of this size: the order of the strategies no longer changes with the size
+const size_t UPLOAD_PROBE_MAX_BYTES = 4 << 20;
+
+// the fastest supported strategy for buffers of the given size on this driver
+UploadStrategy FastestUploadStrategy(size_t bytes, int iterations, double * ms = NULL) {
+    UploadStrategy best = UPLOAD_BUFFER_DATA;
+    double bestMs = 0;
+    for (int s = 0; s < UPLOAD_STRATEGIES; s++) {
+        if (!UploadStrategySupported((UploadStrategy)s)) continue;
+        double t = MeasureUploads((UploadStrategy)s, bytes, iterations);
+        if (s == 0 || t < bestMs) { best = (UploadStrategy)s; bestMs = t; }
+    }
+    if (ms) *ms = bestMs;
+    return best;
+}
+
+// -uploadbench: every strategy on sizes from 4 KB to 16 MB
+int RunUploadBenchmark(const char * fileName) {
+    FILE * out = fopen(fileName, "w");
+    if (!out) {
+        printf("Cannot open %s\n", fileName);
+        return 1;
+    }
+    fprintf(out, "{\n\t\"renderer\": \"%s\",\n\t\"uploads\": [", (const char *)glGetString(GL_RENDERER));
+    const char * separator = "";
+    for (size_t bytes = 4096; bytes <= (16 << 20); bytes *= 16) {
+        int iterations = (int)std::max((size_t)16, std::min((size_t)256, (size_t)(256 << 20) / bytes));
+        for (int s = 0; s < UPLOAD_STRATEGIES; s++) {
+            if (!UploadStrategySupported((UploadStrategy)s)) continue;
+            double ms = MeasureUploads((UploadStrategy)s, bytes, iterations);
+            fprintf(out, "%s\n\t\t{ \"strategy\": \"%s\", \"bytes\": %lu, \"ms_per_upload\": %.4f, \"gb_per_sec\": %.3f }",
+                    separator, uploadStrategyNames[s], (unsigned long)bytes, ms, bytes / ms / 1e6);
+            separator = ",";
+        }
+    }
+    fprintf(out, "\n\t]\n}\n");
+    fclose(out);
+    return 0;
+}
+
 class Object {
     unsigned int vao;	// vertex array object id
-    unsigned int vbo;		// vertex buffer objects
-    std::vector<Complex> points;
+    StreamBuffer stream;    // points transformed on the CPU, 2 floats per vertex
+    unsigned int staticVbo; // interleaved untransformed points and colours
+    const float * colors;   // RGB per point, NULL if the object is white
+    std::vector<Complex> ownPoints;
+    const Complex * points; // ownPoints or a mapped geometry file
+    int count;
+    Mobius transform;       // current transformation of the points
+    bool uploadedOriginal;  // attribute 0 comes from the untransformed points of staticVbo
+    PositionFormat format;  // of the points in staticVbo
+    PositionQuantization quantization;
+    Rotor rotation, backRotation;   // Polar(2, t) and Polar(0.8, -t/2)
+    static const int PARALLEL_THRESHOLD = 1 << 16;  // fewer points are transformed by the calling thread
+    static const int CHUNK = 4096;      // points of a parallel task, 32 KB in and out stay in the L2 cache
 public:
-    Object() {
-        points.push_back(Complex(-1, -1));
-        points.push_back(Complex(0, 1));
-        points.push_back(Complex(1, -1));
-        points.push_back(Complex(0, 0));
+    // the arrow of 4 points, or a regular polygon of nPoints points
+    Object(int nPoints = 4) : rotation(2, 1, animationDt), backRotation(0.8f, -0.5f, animationDt) {
+        if (nPoints == 4) {
+            ownPoints.push_back(Complex(-1, -1));
+            ownPoints.push_back(Complex(0, 1));
+            ownPoints.push_back(Complex(1, -1));
+            ownPoints.push_back(Complex(0, 0));
+        } else {
+            for (int i = 0; i < nPoints; i++) ownPoints.push_back(Polar(1.0f, 2 * (float)M_PI * i / nPoints));
+        }
+        points = &ownPoints[0];
+        count = ownPoints.size();
+        colors = NULL;
+        Create();
+    }
 
+    // the points are used in place from the mapped file, which must stay open
+    Object(const GeometryFile& geometry) : rotation(2, 1, animationDt), backRotation(0.8f, -0.5f, animationDt) {
+        points = geometry.positions;
+        count = geometry.count;
+        colors = geometry.colors;
+        Create();
+    }
+
+    void Create() {
+        uploadedOriginal = false;
         glGenVertexArrays(1, &vao);	// create 1 vertex array object
         glBindVertexArray(vao);		// make it active
-        glGenBuffers(1, &vbo);	// Generate 1 vertex buffer objects
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        // Map Attribute Array 0 to the current bound vertex buffer (vbo[0])
-        glEnableVertexAttribArray(0);
+        glGenBuffers(1, &staticVbo);
+        SetStaticVertices();        // attributes 0 and 1 from staticVbo
+        stream.Create((UploadStrategy)uploadStrategy);
+        UseTransformedPoints();
+        Animate(0);
+        Update();
+    }
+
+    // the points in the static format with their colours, the colours are used by both transformation paths
+    void SetStaticVertices() {
+        format = staticPositionFormat;
+        quantization = FitPositions(points, count, format);
+        switch (format) {
+        case POSITION_FLOAT: UploadStaticVertices<Complex>(staticVbo, points, colors, count, quantization); break;
+        case POSITION_HALF: UploadStaticVertices<Half2>(staticVbo, points, colors, count, quantization); break;
+        case POSITION_FIXED16: UploadStaticVertices<Fixed2>(staticVbo, points, colors, count, quantization); break;
+        }
+        UseOriginalPoints();
+    }
+
+    // attribute 0 from the data written last by Update, its buffer and offset may change with every update
+    void UseTransformedPoints() {
+        glBindBuffer(GL_ARRAY_BUFFER, stream.Vbo());
         // Data organization of Attribute Array 0
         glVertexAttribPointer(0,			// Attribute Array 0
                               2, GL_FLOAT,  // components/attribute, component type
                               GL_FALSE,		// not in fixed point format, do not normalized
-                              0, NULL);     // stride and offset: it is tightly packed
-        Animate(0);
+                              0, (const void *)stream.Offset());     // stride and offset: it is tightly packed
+        uploadedOriginal = false;
     }
 
-    void Animate(float t) {
-        glBindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
+    // attributes 0 and 1 from the interleaved staticVbo
+    void UseOriginalPoints() {
+        glBindBuffer(GL_ARRAY_BUFFER, staticVbo);
+        switch (format) {          // sets the colour attribute again, it is unchanged
+        case POSITION_FLOAT: StaticVertex<Complex>::Layout(); break;
+        case POSITION_HALF: StaticVertex<Half2>::Layout(); break;
+        case POSITION_FIXED16: StaticVertex<Fixed2>::Layout(); break;
+        }
+        uploadedOriginal = true;
+    }
+
+    // state at time t
+    void Animate(double t) {
+        rotation.Reset(t);
+        backRotation.Reset(t);
+    }
 
-        std::vector<Complex> transPoints(points.size());
-        for (unsigned int i = 0; i < points.size(); i++) {
-            transPoints[i] = ((points[i] - Complex(1, -1)) * Polar(2, t) + Complex(1, -1) + Complex(2, 3)) * Polar(0.8, -t/2);
+    // state n * animationDt later, a complex multiplication per rotation and step
+    void Step(int n) {
+        for (int i = 0; i < n; i++) {
+            rotation.Advance();
+            backRotation.Advance();
         }
-        glBufferData(GL_ARRAY_BUFFER,      // copy to the GPU
-                     transPoints.size() * 2 * sizeof(float), // number of the vbo in bytes
-                     &transPoints[0],		   // address of the data array on the CPU
-                     GL_DYNAMIC_DRAW);	   // copy to GPU
+    }
+
+    // the points of the frame, alpha: between the state of the last step (1) and of the step before (0)
+    void Update(float alpha = 1) {
+        // ((p - pivot) * Polar(2, t) + pivot + Complex(2, 3)) * Polar(0.8, -t/2) composed to a single transformation
+        Complex pivot(1, -1);
+        transform = Mobius::Multiply(backRotation.At(alpha)) * Mobius::Translate(pivot + Complex(2, 3)) *
+                    Mobius::Multiply(rotation.At(alpha)) * Mobius::Translate(Complex(0, 0) - pivot);
+
+        if (mobiusOnGpu) {                  // the vertex shader transforms the static points
+            if (!uploadedOriginal) {
+                glBindVertexArray(vao);
+                UseOriginalPoints();
+            }
+            return;
+        }
+        // a mapping of the GPU buffer or frame allocator memory, depending on the upload strategy
+        int n = count;
+        Complex * transPoints = (Complex *)stream.Begin(n * sizeof(Complex));
+        if (n >= PARALLEL_THRESHOLD) {
+            threadPool.ParallelFor(n, CHUNK, [this, transPoints](int begin, int end) {
+                transform.Apply(points + begin, transPoints + begin, end - begin);
+            });
+        } else {
+            transform.Apply(points, transPoints, n);
+        }
+        stream.End(transPoints);           // copy to the GPU
+        glBindVertexArray(vao);
+        UseTransformedPoints();
     }
 
     void Draw() {
@@ -282,110 +1534,860 @@ public:
         if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVPTransform); // set uniform variable MVP to the MVPTransform
         else printf("uniform MVP cannot be set\n");
 
-        location = glGetUniformLocation(shaderProgram, "color");
-        if (location >= 0) glUniform3f(location, 1, 1, 1);
+        Mobius m = mobiusOnGpu ? transform : Mobius();  // identity if the points are transformed on the CPU
+        PositionQuantization q = uploadedOriginal ? quantization : PositionQuantization();
+        const char * names[6] = { "mobiusA", "mobiusB", "mobiusC", "mobiusD", "positionScale", "positionOffset" };
+        Complex coefficients[6] = { m.a, m.b, m.c, m.d, q.scale, q.offset };
+        for (int i = 0; i < 6; i++) {
+            location = glGetUniformLocation(shaderProgram, names[i]);
+            if (location >= 0) glUniform2f(location, coefficients[i].x, coefficients[i].y);
+        }
 
         glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-        glDrawArrays(GL_LINE_LOOP, 0, points.size());	// draw a single triangle with vertices defined in vao
+        glDrawArrays(GL_LINE_LOOP, 0, count);	// draw a single triangle with vertices defined in vao
+        if (!uploadedOriginal) stream.Drawn();
     }
 };
 
-// The virtual world: collection of two objects
-Object * object;
+// the frame benchmark drives the animation with deterministic timestamps instead of the wall clock
+Nanoseconds benchmarkTime = -1;
+int benchmarkFrames = 0;				// frames of the benchmark, 0: interactive run
+const char * benchmarkFile = NULL;		// JSON output of the benchmark, stdout if NULL
+
+//---------------------------------------------------------------------------------------------
+// Input log: -record file saves every event and time sample, -replay file runs them again as fast as possible
+//---------------------------------------------------------------------------------------------
+// The file starts with "ILOG" and the version, then a record is a type byte and a payload whose size depends on
+// the type. Time samples are logged where ElapsedTime reads the clock, so the replayed callbacks see exactly the
+// times of the recording. Only logs of this version are replayed: older ones sampled the time at other places,
+// so the samples would not be read where they were taken.
+const unsigned int INPUT_LOG_VERSION = 3;           // 3: onDisplay samples the time too
+
+class InputLog {
+    FILE * file;
+    bool replaying;
+public:
+    enum Type { KEY_DOWN, KEY_UP, MOUSE, MOTION, IDLE = 5, DISPLAY, TIME_NS };  // 4 was the msec time sample of version 1
+    struct Record {
+        unsigned char type, code, state;    // code: key or mouse button
+        short x, y;
+        Nanoseconds time;
+        Record(unsigned char type0 = IDLE, unsigned char code0 = 0, unsigned char state0 = 0, int x0 = 0, int y0 = 0, Nanoseconds time0 = 0) {
+            type = type0; code = code0; state = state0; x = x0; y = y0; time = time0;
+        }
+    };
 
-// Initialization, create an OpenGL context
-void onInitialization() {
-    glViewport(0, 0, windowWidth, windowHeight);
+    InputLog() { file = NULL; replaying = false; }
 
-    // Create objects by setting up their vertex data on the GPU
-    object = new Object;
+    bool Open(const char * fileName, bool replay) {
+        file = fopen(fileName, replay ? "rb" : "wb");
+        if (!file) {
+            printf("Cannot open input log %s\n", fileName);
+            return false;
+        }
+        replaying = replay;
+        if (!replay) {
+            fwrite("ILOG", 1, 4, file);
+            fwrite(&INPUT_LOG_VERSION, 4, 1, file);
+            return true;
+        }
+        // checked here, before the window is created, so a wrong file fails without opening a window
+        unsigned char magic[4] = { 0, 0, 0, 0 };
+        unsigned int version = 0;
+        bool header = fread(magic, 1, 4, file) == 4 && memcmp(magic, "ILOG", 4) == 0 && fread(&version, 4, 1, file) == 1;
+        if (!header || version != INPUT_LOG_VERSION) {
+            printf(!header ? "%s is not an input log\n" : "%s is an input log of an unsupported version\n", fileName);
+            Close();
+            return false;
+        }
+        return true;
+    }
+    void Close() {
+        if (file) fclose(file);
+        file = NULL;
+    }
+    bool Recording() { return file && !replaying; }
+    bool Replaying() { return file && replaying; }
+
+    void Write(const Record& r) {
+        if (!Recording()) return;
+        unsigned char buffer[12];
+        int n = 0;
+        buffer[n++] = r.type;
+        if (r.type == KEY_DOWN || r.type == KEY_UP || r.type == MOUSE) buffer[n++] = r.code;
+        if (r.type == MOUSE) buffer[n++] = r.state;
+        if (r.type <= MOTION) {
+            memcpy(buffer + n, &r.x, 2);
+            memcpy(buffer + n + 2, &r.y, 2);
+            n += 4;
+        }
+        if (r.type == TIME_NS) {
+            memcpy(buffer + n, &r.time, 8);
+            n += 8;
+        }
+        fwrite(buffer, 1, n, file);
+    }
 
-    // Create vertex shader from string
-    unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    if (!vertexShader) {
-        printf("Error in vertex shader creation\n");
-        exit(1);
+    bool Read(Record& r) {
+        if (!Replaying() || fread(&r.type, 1, 1, file) != 1) return false;
+        bool ok = true;
+        if (r.type == KEY_DOWN || r.type == KEY_UP || r.type == MOUSE) ok = ok && fread(&r.code, 1, 1, file) == 1;
+        if (r.type == MOUSE) ok = ok && fread(&r.state, 1, 1, file) == 1;
+        if (r.type <= MOTION) ok = ok && fread(&r.x, 2, 1, file) == 1 && fread(&r.y, 2, 1, file) == 1;
+        if (r.type == TIME_NS) ok = ok && fread(&r.time, 8, 1, file) == 1;
+        if (!ok || r.type > TIME_NS || r.type == MOTION + 1) {
+            printf("Corrupt input log\n");
+            exit(1);
+        }
+        return true;
     }
-    glShaderSource(vertexShader, 1, &vertexSource, NULL);
-    glCompileShader(vertexShader);
-    checkShader(vertexShader, "Vertex shader error");
 
-    // Create fragment shader from string
-    unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    if (!fragmentShader) {
-        printf("Error in fragment shader creation\n");
-        exit(1);
+    // the clock sample now is logged when recording, and replaced by the logged one when replaying
+    Nanoseconds Time(Nanoseconds now) {
+        if (Recording()) Write(Record(TIME_NS, 0, 0, 0, 0, now));
+        if (!Replaying()) return now;
+        Record r;
+        if (!Read(r) || r.type != TIME_NS) {
+            printf("Replay diverged: the recording has no time sample here\n");
+            exit(1);
+        }
+        return r.time;
     }
-    glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-    glCompileShader(fragmentShader);
-    checkShader(fragmentShader, "Fragment shader error");
+};
 
-    // Attach shaders to a single program
-    shaderProgram = glCreateProgram();
-    if (!shaderProgram) {
-        printf("Error in shader program creation\n");
-        exit(1);
+InputLog inputLog;
+
+// nsec since the start of the program
+Nanoseconds ElapsedTime() {
+    return benchmarkTime >= 0 ? benchmarkTime : inputLog.Time(MonotonicTime());
+}
+
+//---------------------------------------------------------------------------------------------
+// Frame capture: -capture name.ppm writes name00000.ppm, name00001.ppm..., -capture name.rgba a raw RGBA stream
+//---------------------------------------------------------------------------------------------
+// The frame is read into a ring of pixel pack buffers and mapped only RING - 1 frames later, when the copy
+// has surely finished, so glReadPixels does not stall the pipeline. A background thread writes the files;
+// if it falls behind, frames are dropped instead of slowing down the rendering.
+class FrameCapture {
+    static const int RING = 3;		// pixel pack buffers in flight
+    static const int POOL = 8;		// frames waiting for the writer thread at most
+    std::string name;				// file name without the extension
+    bool raw;						// single raw stream instead of an image sequence
+    FILE * rawFile;
+    int width, height;
+    unsigned int pbo[RING];
+    long frames, written, dropped;	// frames read back, written out and dropped for lack of room
+    std::vector<std::vector<unsigned char> > pool;
+    std::vector<int> freeSlots;		// pool entries that can be filled
+    std::deque<std::pair<int, long> > queue;	// pool entries and frame numbers to be written
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::thread writer;
+    bool stop;
+
+    void Write(const unsigned char * rgba, long frame) {	// rows are bottom up in OpenGL
+        if (raw) {
+            for (int y = height - 1; y >= 0; y--) fwrite(rgba + y * width * 4, 4, width, rawFile);
+            return;
+        }
+        char fileName[1024];
+        snprintf(fileName, sizeof(fileName), "%s%05ld.ppm", name.c_str(), frame);
+        FILE * file = fopen(fileName, "wb");
+        if (!file) {
+            printf("Cannot write %s\n", fileName);
+            return;
+        }
+        fprintf(file, "P6\n%d %d\n255\n", width, height);
+        std::vector<unsigned char> row(width * 3);
+        for (int y = height - 1; y >= 0; y--) {
+            for (int x = 0; x < width; x++)
+                for (int c = 0; c < 3; c++) row[x * 3 + c] = rgba[(y * width + x) * 4 + c];
+            fwrite(&row[0], 1, row.size(), file);
+        }
+        fclose(file);
     }
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
 
-    // Connect the fragmentColor to the frame buffer memory
-    glBindFragDataLocation(shaderProgram, 0, "fragmentColor");	// fragmentColor goes to the frame buffer memory
+    void WriterLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wakeUp.wait(lock, [this]() { return stop || !queue.empty(); });
+            if (queue.empty()) return;		// stopped and everything is written
+            std::pair<int, long> job = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            Write(&pool[job.first][0], job.second);
+            lock.lock();
+            freeSlots.push_back(job.first);
+            written++;
+        }
+    }
+
+    void Collect(long frame) {		// hands the pixels of an earlier frame over to the writer
+        int slot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (freeSlots.empty()) {
+                dropped++;
+                return;
+            }
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[frame % RING]);
+        void * pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, width * height * 4, GL_MAP_READ_BIT);
+        if (pixels) memcpy(&pool[slot][0], pixels, width * height * 4);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pixels) queue.push_back(std::make_pair(slot, frame));
+        else freeSlots.push_back(slot);
+        wakeUp.notify_one();
+    }
+public:
+    FrameCapture() { rawFile = NULL; width = height = 0; frames = written = dropped = 0; stop = false; }
+
+    bool Active() { return width > 0; }
+
+    bool Start(const char * fileName, int width0, int height0) {
+        name = fileName;
+        size_t dot = name.rfind('.');
+        std::string extension = dot == std::string::npos ? "" : name.substr(dot);
+        raw = (extension == ".rgba");
+        if (!raw && extension != ".ppm") {
+            printf("Capture file %s should be .ppm or .rgba\n", fileName);
+            return false;
+        }
+        if (raw) {
+            rawFile = fopen(fileName, "wb");
+            if (!rawFile) {
+                printf("Cannot write %s\n", fileName);
+                return false;
+            }
+        }
+        name = name.substr(0, dot);
+        width = width0; height = height0;
+        glGenBuffers(RING, pbo);
+        for (int i = 0; i < RING; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        pool.resize(POOL, std::vector<unsigned char>(width * height * 4));
+        for (int i = 0; i < POOL; i++) freeSlots.push_back(i);
+        writer = std::thread(&FrameCapture::WriterLoop, this);
+        return true;
+    }
+
+    // called after the frame is rendered, before the buffers are swapped
+    void Capture() {
+        if (!Active()) return;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[frames % RING]);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);	// asynchronous into the buffer
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        frames++;
+        if (frames >= RING) Collect(frames - RING);		// its buffer is read again in the next frame
+    }
+
+    // writes the pending frames and stops the writer; without a GL context the frames in flight are lost
+    void Finish(bool contextAlive) {
+        if (!Active()) return;
+        if (contextAlive)
+            for (long frame = std::max(0L, frames - RING + 1); frame < frames; frame++) Collect(frame);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            wakeUp.notify_one();
+        }
+        writer.join();
+        if (rawFile) {
+            fclose(rawFile);
+            printf("Captured %ld frames, play with: ffplay -f rawvideo -pixel_format rgba -video_size %dx%d %s.rgba\n",
+                written, width, height, name.c_str());
+        } else {
+            printf("Captured %ld frames into %s%%05d.ppm\n", written, name.c_str());
+        }
+        if (dropped > 0) printf("%ld frames dropped, the writer could not keep up\n", dropped);
+        if (contextAlive) glDeleteBuffers(RING, pbo);
+        width = height = 0;
+    }
+};
 
-    // program packaging
-    glLinkProgram(shaderProgram);
-    checkLinking(shaderProgram);
-    // make this program run
-    glUseProgram(shaderProgram);
+FrameCapture capture;
+
+const char * captureFile = NULL;	// set on the command line
+
+//---------------------------------------------------------------------------------------------
+// Dynamic resolution: the frame is drawn into an offscreen framebuffer at a fraction of the window
+// size and upsampled to the window. The fraction follows the GPU time of the frames, measured by
+// timestamp queries read a few frames later, so that it stays within the budget: -frametime ms.
+// -resolution scale draws at a fixed fraction instead.
+//---------------------------------------------------------------------------------------------
+const float MIN_RESOLUTION_SCALE = 0.25f;
+
+class DynamicResolution {
+    static const int QUERIES = 4;	// frames in flight, the queries of a frame are read when its slot is reused
+    unsigned int fbo, colorBuffer, depthBuffer;
+    unsigned int queries[QUERIES][2];	// timestamps at the start and at the end of the frames
+    long frame;
+    int width, height;				// of the window and the framebuffer
+    float scale;					// of both sides
+    double budget;					// ms of GPU time per frame, 0: fixed scale
+    double smoothed;				// exponential average of the measured ms at the current scale, 0: none yet
+    int settle;						// frames until the measurements are at the current scale
+    long changes;
+
+    void Measure() {
+        if (frame < QUERIES) return;
+        unsigned int * q = queries[frame % QUERIES];
+        int available = 0;
+        glGetQueryObjectiv(q[1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return;		// not waited for, the frame is simply not measured
+        GLuint64 start = 0, end = 0;
+        glGetQueryObjectui64v(q[0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(q[1], GL_QUERY_RESULT, &end);
+        if (settle > 0) {
+            settle--;
+            return;
+        }
+        double ms = (end - start) / 1e6;
+        smoothed = smoothed == 0 ? ms : 0.8 * smoothed + 0.2 * ms;
+        float newScale = scale;
+        if (smoothed > budget) newScale = scale * (float)std::max(0.8, sqrt(budget / smoothed));	// time ~ pixels
+        else if (smoothed < 0.7 * budget) newScale = scale * 1.05f;
+        newScale = std::min(1.0f, std::max(MIN_RESOLUTION_SCALE, newScale));
+        if (fabsf(newScale - scale) < 0.01f) return;
+        scale = newScale;
+        smoothed = 0;
+        settle = QUERIES;			// the frames in flight are still at the old scale
+        changes++;
+    }
+public:
+    DynamicResolution() { fbo = 0; frame = 0; scale = 1; budget = smoothed = 0; settle = 0; changes = 0; }
+
+    bool Active() const { return fbo != 0; }
+    float Scale() const { return scale; }
+    long Changes() const { return changes; }
+    int ScaledWidth() const { return std::max(1, (int)(width * scale + 0.5f)); }
+    int ScaledHeight() const { return std::max(1, (int)(height * scale + 0.5f)); }
+
+    // budgetMs > 0 adapts the scale, otherwise the frames are drawn at fixedScale
+    bool Start(int width0, int height0, double budgetMs, float fixedScale) {
+        width = width0;
+        height = height0;
+        budget = budgetMs;
+        scale = budget > 0 ? 1 : std::min(1.0f, std::max(MIN_RESOLUTION_SCALE, fixedScale));
+        glGenFramebuffers(1, &fbo);		// full size, a smaller scale uses a part of it
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glGenRenderbuffers(1, &colorBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+        glGenRenderbuffers(1, &depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (!complete) {
+            printf("Offscreen framebuffer of %dx%d is not supported\n", width, height);
+            return false;
+        }
+        glGenQueries(2 * QUERIES, &queries[0][0]);
+        return true;
+    }
+
+    // before anything of the frame is drawn
+    void Begin() {
+        if (!Active()) return;
+        if (budget > 0) Measure();
+        glQueryCounter(queries[frame % QUERIES][0], GL_TIMESTAMP);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, ScaledWidth(), ScaledHeight());
+    }
+
+    // after the frame is drawn, upsamples it into the window
+    void End() {
+        if (!Active()) return;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, ScaledWidth(), ScaledHeight(), 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+        glQueryCounter(queries[frame % QUERIES][1], GL_TIMESTAMP);
+        frame++;
+    }
+};
+
+DynamicResolution resolution;
+double frameTimeBudget = 0;			// ms, set on the command line
+float fixedResolution = 0;			// set on the command line
+
+// The virtual world: collection of objects, all of them transformed in the same way
+std::vector<Object *> objects;
+int nObjects = 1;       // set on the command line
+int nPoints = 4;        // points per object
+GeometryFile geometry;  // points and colours of the objects if a geometry file is given
+
+// after the initialization: starts the capture and runs the replay or the benchmark, defined with them below
+void StartRun();
+
+// Initialization, create an OpenGL context
+void onInitialization() {
+    if (uploadBenchmarkFile) exit(RunUploadBenchmark(uploadBenchmarkFile));
+    glViewport(0, 0, windowWidth, windowHeight);
+
+    // compiled by the driver while the objects are set up
+    EnableParallelShaderCompile();
+    shaderProgram = gpuProgram.Create(vertexSource, fragmentSource, "fragmentColor");
+
+    if (uploadStrategy < 0) {       // measured with the size of the objects, up to the probe size
+        size_t bytes = std::max((size_t)4096, (geometry.count > 0 ? geometry.count : nPoints) * sizeof(Complex));
+        size_t probe = std::min(bytes, UPLOAD_PROBE_MAX_BYTES);
+        double ms;
+        uploadStrategy = FastestUploadStrategy(probe, 16, &ms);
+        printf("Upload strategy: %s, %.3f ms per %lu KB", uploadStrategyNames[uploadStrategy], ms, (unsigned long)(probe >> 10));
+        if (probe < bytes) printf(", chosen for %lu KB", (unsigned long)(bytes >> 10));
+        printf("\n");
+    }
+
+    // Create objects by setting up their vertex data on the GPU
+    for (int i = 0; i < nObjects; i++) objects.push_back(geometry.count > 0 ? new Object(geometry) : new Object(nPoints));
+    threadPool.Start(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+    StartRun();
 }
 
 void onExit() {
+    capture.Finish(false);
+    inputLog.Close();
+    printf("Heap allocations in %ld of %ld frames, at most %ld in a frame\n",
+        frameAllocations.allocatingFrames, frameAllocations.frames, frameAllocations.maxPerFrame);
+    frameIntervals.Print();
+    if (animationSteps.Skipped() > 0) printf("The simulation fell behind %ld times, the lag was skipped\n", animationSteps.Skipped());
     glDeleteProgram(shaderProgram);
     printf("exit");
 }
 
 // Window has become invalid: Redraw
 void onDisplay() {
+    inputLog.Write(InputLog::Record(InputLog::DISPLAY));
+    resolution.Begin();                                 // into the offscreen framebuffer if it is on
+    gpuProgram.Use();
     glClearColor(0, 0, 0, 0);							// background color
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
 
-    object -> Draw();
+    for (size_t i = 0; i < objects.size(); i++) objects[i] -> Draw();
+    frameIntervals.Add(ElapsedTime());                  // when the frames are drawn, not when they are animated
+    resolution.End();                                   // upsampled into the window
+    capture.Capture();                                  // read back for the frame capture, if it is on
     glutSwapBuffers();									// exchange the two buffers
+    frameAllocator.Reset();                             // the transient data of this frame is not needed any more
+    frameAllocations.EndFrame();
 }
 
 // Key of ASCII code pressed
 void onKeyboard(unsigned char key, int pX, int pY) {
+    inputLog.Write(InputLog::Record(InputLog::KEY_DOWN, key, 0, pX, pY));   // if recording
     if (key == 'd') glutPostRedisplay();         // if d, invalidate display, i.e. redraw
+    if (key == 'g') mobiusOnGpu = !mobiusOnGpu;  // switch between CPU and GPU transformation
+    if (key == 'i') incrementalAnimation = !incrementalAnimation;   // switch between stepping and direct evaluation
 }
 
 // Key of ASCII code released
 void onKeyboardUp(unsigned char key, int pX, int pY) {
-
+    inputLog.Write(InputLog::Record(InputLog::KEY_UP, key, 0, pX, pY));
 }
 
 // Mouse click event
 void onMouse(int button, int state, int pX, int pY) {
+    inputLog.Write(InputLog::Record(InputLog::MOUSE, button, state, pX, pY));
     if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {  // GLUT_LEFT_BUTTON / GLUT_RIGHT_BUTTON and GLUT_DOWN / GLUT_UP
     }
 }
 
 // Move mouse with key pressed
 void onMouseMotion(int pX, int pY) {
+    inputLog.Write(InputLog::Record(InputLog::MOTION, 0, 0, pX, pY));
 }
 
 // Idle event indicating that some time elapsed: do animation here
 void onIdle() {
-    long time = glutGet(GLUT_ELAPSED_TIME); // elapsed time since the start of the program
-    float sec = time / 1000.0f;				// convert msec to sec
+    inputLog.Write(InputLog::Record(InputLog::IDLE));
+    Nanoseconds time = ElapsedTime();       // elapsed time since the start of the program
+    double sec = (double)time / NANOSECONDS_PER_SECOND;    // convert nsec to sec
     camera.Animate(sec);					// animate the camera
-    object -> Animate(sec);					// animate the triangle object
+    if (incrementalAnimation) {             // fixed steps until the animation reaches the current time
+        int steps = animationSteps.Advance(time);
+        float alpha = animationSteps.Alpha(time);
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (steps < 0) objects[i] -> Animate(animationSteps.Seconds());    // (re)start, or too far behind to catch up
+            else objects[i] -> Step(steps);
+            objects[i] -> Update(alpha);    // interpolated between the last two steps
+        }
+    } else {
+        for (size_t i = 0; i < objects.size(); i++) {   // animate the triangle objects
+            objects[i] -> Animate(sec);
+            objects[i] -> Update();
+        }
+        animationSteps.Unsync();
+    }
     glutPostRedisplay();					// redraw the scene
 }
 
+//---------------------------------------------------------------------------------------------
+// Microbenchmarks of the math core without a window: program -microbench [file.json]
+//---------------------------------------------------------------------------------------------
+volatile float benchmarkSink;	// results are written here, so the measured code is not optimized away
+
+// the math types with every scalar type they are written for, so a member that does not compile for one fails the build
+template struct ComplexT<double>;
+template struct ComplexT<Pack4>;
+template struct mat4T<double>;
+template struct mat4T<Pack4>;
+template struct vec4T<double>;
+template struct vec4T<Pack4>;
+
+// distance of a point from its double precision reference, relative to the length of the reference
+float RelativeError(const ComplexT<double>& exact, double x, double y) {
+    return (float)(sqrt((x - exact.x) * (x - exact.x) + (y - exact.y) * (y - exact.y)) / sqrt(exact.x * exact.x + exact.y * exact.y));
+}
+
+struct MicroBenchmark {
+    FILE * out;
+    bool first;
+
+    MicroBenchmark(FILE * out0) { out = out0; first = true; }
+
+    // runs body (n operations) repeatedly for at least 50 msec and reports one JSON record
+    template<class F> void Run(const char * name, int n, F body) {
+        body();     // warm up caches and lazily allocated buffers
+        long allocations = allocationCount;
+        long repeats = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        double elapsed;
+        do {
+            body();
+            repeats++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < 0.05);
+        double ops = (double)repeats * n;
+        fprintf(out, "%s\n\t\t{ \"name\": \"%s\", \"size\": %d, \"ns_per_op\": %.3f, \"ops_per_sec\": %.0f, \"allocations_per_op\": %.6f }",
+                first ? "" : ",", name, n, elapsed * 1e9 / ops, ops / elapsed, (allocationCount - allocations) / ops);
+        first = false;
+    }
+
+    // reports one JSON record of an accuracy check instead of a timing
+    void Check(const char * name, int n, float maxRelativeError) {
+        fprintf(out, "%s\n\t\t{ \"name\": \"%s\", \"size\": %d, \"max_relative_error\": %g }", first ? "" : ",", name, n, maxRelativeError);
+        first = false;
+    }
+};
+
+int RunMicroBenchmarks(const char * fileName) {
+    FILE * out = fileName ? fopen(fileName, "w") : stdout;
+    if (!out) {
+        printf("Cannot open %s\n", fileName);
+        return 1;
+    }
+    fprintf(out, "{\n\t\"program\": \"complex transformation\",\n\t\"benchmarks\": [");
+    MicroBenchmark bench(out);
+
+    const int sizes[] = { 1024, 65536, 1048576 };
+    for (int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        std::vector<float> r(n), phi(n);
+        std::vector<Complex> a(n), b(n), c(n);
+        for (int i = 0; i < n; i++) {
+            r[i] = 1 + 0.001f * i;
+            phi[i] = 0.001f * i;
+            a[i] = Complex(1 + 0.5f * i / n, 0.25f);
+            b[i] = Complex(0.5f, 1 - 0.5f * i / n);
+        }
+
+        bench.Run("Complex::operator*", n, [&]() {
+            for (int i = 0; i < n; i++) c[i] = a[i] * b[i];
+            benchmarkSink = c[n - 1].x;
+        });
+        bench.Run("Complex::operator/", n, [&]() {
+            for (int i = 0; i < n; i++) c[i] = a[i] / b[i];
+            benchmarkSink = c[n - 1].x;
+        });
+        bench.Run("Polar", n, [&]() {
+            for (int i = 0; i < n; i++) c[i] = Polar(r[i], phi[i]);
+            benchmarkSink = c[n - 1].x;
+        });
+        bench.Run("Polar batch", n, [&]() {
+            Polar(&r[0], &phi[0], &c[0], n);
+            benchmarkSink = c[n - 1].x;
+        });
+
+        // the transformation of Object::Update at t = 1, once step by step and once as a composed Moebius
+        Complex pivot(1, -1), rot = Polar(2.0f, 1.0f), backRot = Polar(0.8f, -0.5f);
+        Mobius transform = Mobius::Multiply(backRot) * Mobius::Translate(pivot + Complex(2, 3)) *
+                           Mobius::Multiply(rot) * Mobius::Translate(Complex(0, 0) - pivot);
+        bench.Run("Animate points, direct", n, [&]() {
+            for (int i = 0; i < n; i++) c[i] = ((a[i] - pivot) * rot + pivot + Complex(2, 3)) * backRot;
+            benchmarkSink = c[n - 1].x;
+        });
+        bench.Run("Animate points, Mobius::Apply", n, [&]() {
+            transform.Apply(&a[0], &c[0], n);
+            benchmarkSink = c[n - 1].x;
+        });
+
+        std::vector<mat4> m(n);
+        std::vector<vec4> v(n);
+        for (int i = 0; i < n; i++) {
+            m[i] = camera.V() * camera.P();
+            v[i] = vec4(a[i].x, a[i].y, 0, 1);
+        }
+        bench.Run("mat4::operator*", n, [&]() {
+            for (int i = 1; i < n; i++) m[i] = m[i - 1] * m[i];
+            benchmarkSink = m[n - 1].m[3][3];
+        });
+        bench.Run("vec4 * mat4", n, [&]() {
+            for (int i = 0; i < n; i++) v[i] = v[i] * m[0];
+            benchmarkSink = v[n - 1].v[0];
+        });
+    }
+
+    // the transformation of the points in Pack4, four points at a time, and the errors of the float and Pack4
+    // points and of the float camera transformation against double
+    const int n = 65536;
+    std::vector<Complex> z(n), w(n);
+    std::vector<ComplexT<Pack4> > z4(n / 4), w4(n / 4);
+    for (int i = 0; i < n; i++) {
+        z[i] = Complex(1 + 0.5f * i / n, 0.25f);
+        z4[i / 4].x.v[i % 4] = z[i].x;
+        z4[i / 4].y.v[i % 4] = z[i].y;
+    }
+    Complex pivot(1, -1);
+    Mobius transform = Mobius::Inversion() * Mobius::Translate(pivot) * Mobius::Multiply(Polar(2.0f, 1.0f));
+    MobiusT<Pack4> transform4(transform);
+    bench.Run("Animate points, Pack4", n, [&]() {
+        for (int i = 0; i < n / 4; i++) w4[i] = transform4(z4[i]);
+        benchmarkSink = w4[n / 4 - 1].x.v[3];
+    });
+    MobiusT<double> exactTransform(transform);
+    mat4T<double> exactMatrix(camera.V() * camera.P());
+    float floatError = 0, packError = 0, matrixError = 0;
+    transform.Apply(&z[0], &w[0], n);
+    for (int i = 0; i < n; i++) {
+        ComplexT<double> exact = exactTransform(ComplexT<double>(z[i]));
+        floatError = std::max(floatError, RelativeError(exact, w[i].x, w[i].y));
+        packError = std::max(packError, RelativeError(exact, w4[i / 4].x.v[i % 4], w4[i / 4].y.v[i % 4]));
+        vec4T<double> exactClip = vec4T<double>(z[i].x, z[i].y, 0, 1) * exactMatrix;
+        vec4 clip = vec4(z[i].x, z[i].y, 0, 1) * (camera.V() * camera.P());
+        matrixError = std::max(matrixError, RelativeError(ComplexT<double>(exactClip.v[0], exactClip.v[1]), clip.v[0], clip.v[1]));
+    }
+    bench.Check("Animate points, float - double", n, floatError);
+    bench.Check("Animate points, Pack4 - double", n, packError);
+    bench.Check("vec4 * mat4, float - double", n, matrixError);
+    fprintf(out, "\n\t]\n}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+// calls the handlers in the recorded order without waiting, the time samples are consumed by ElapsedTime;
+// the handlers log the events themselves, which does nothing while replaying. The replay is not headless:
+// onDisplay draws and reads back the frames, and GLUT gives a GL context only with a window, so it runs
+// after glutCreateWindow but instead of the event loop
+int RunReplay() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long events = 0, frames = 0;
+    InputLog::Record r;
+    while (inputLog.Read(r)) {
+        switch (r.type) {
+        case InputLog::KEY_DOWN: onKeyboard(r.code, r.x, r.y); break;
+        case InputLog::KEY_UP: onKeyboardUp(r.code, r.x, r.y); break;
+        case InputLog::MOUSE: onMouse(r.code, r.state, r.x, r.y); break;
+        case InputLog::MOTION: onMouseMotion(r.x, r.y); break;
+        case InputLog::IDLE: onIdle(); break;
+        case InputLog::DISPLAY: onDisplay(); frames++; break;
+        default:
+            printf("Replay diverged: a time sample was not read\n");
+            exit(1);
+        }
+        events++;
+    }
+    glFinish();
+    capture.Finish(true);
+    inputLog.Close();
+    printf("Replayed %ld events, %ld frames in %.3f sec\n", events, frames,
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    return 0;
+}
+
+//---------------------------------------------------------------------------------------------
+// Frame benchmark: the onIdle, onDisplay loop at 60 Hz timestamps, -benchmark frames [-json file]
+//---------------------------------------------------------------------------------------------
+struct FrameStatistics {
+    std::vector<double> ms;
+
+    double Percentile(double p) {	// nearest rank
+        std::vector<double> sorted = ms;
+        std::sort(sorted.begin(), sorted.end());
+        int rank = (int)ceil(p / 100 * sorted.size()) - 1;
+        return sorted[std::max(0, rank)];
+    }
+
+    void Write(FILE * out, const char * name) {
+        double sum = 0;
+        for (size_t i = 0; i < ms.size(); i++) sum += ms[i];
+        fprintf(out, "\t\"%s\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f }",
+            name, sum / ms.size(), Percentile(50), Percentile(95), Percentile(99), Percentile(100));
+    }
+};
+
+// The first frames warm up caches and drivers and are not recorded.
+// Every frame is finished with glFinish, so frame time is the latency from onIdle to the completed image,
+// submission is the CPU time of onIdle and onDisplay, and the GPU time is measured by a timer query.
+int RunFrameBenchmark(const char * program, const char * scene) {
+    FrameStatistics frame, submission, gpu;
+    unsigned int query;
+    glGenQueries(1, &query);
+    const int warmUp = 10;
+    long allocations = 0, sizes[ALLOCATION_SIZE_CLASSES];
+    frame.ms.reserve(benchmarkFrames);		// the statistics do not allocate in the measured frames
+    submission.ms.reserve(benchmarkFrames);
+    gpu.ms.reserve(benchmarkFrames);
+    for (int i = 0; i < warmUp + benchmarkFrames; i++) {
+        if (i == warmUp) {
+            frameAllocations.Restart();
+            allocations = allocationCount;
+            for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) sizes[c] = allocationSizes[c];
+        }
+        benchmarkTime = i * NANOSECONDS_PER_SECOND / 60;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        onIdle();
+        onDisplay();
+        glEndQuery(GL_TIME_ELAPSED);
+        std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+        glFinish();
+        std::chrono::steady_clock::time_point finished = std::chrono::steady_clock::now();
+        GLuint64 gpuNanoseconds = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuNanoseconds);
+        if (i < warmUp) continue;
+        submission.ms.push_back(std::chrono::duration<double, std::milli>(submitted - start).count());
+        frame.ms.push_back(std::chrono::duration<double, std::milli>(finished - start).count());
+        gpu.ms.push_back(gpuNanoseconds / 1e6);
+    }
+    allocations = allocationCount - allocations;
+    for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) sizes[c] = allocationSizes[c] - sizes[c];
+    glDeleteQueries(1, &query);
+    capture.Finish(true);
+
+    FILE * out = benchmarkFile ? fopen(benchmarkFile, "w") : stdout;
+    if (!out) {
+        printf("Cannot open %s\n", benchmarkFile);
+        return 1;
+    }
+    fprintf(out, "{\n\t\"program\": \"%s\",\n\t\"renderer\": \"%s\",\n\t\"scene\": { %s },\n\t\"frames\": %d,\n",
+        program, (const char *)glGetString(GL_RENDERER), scene, benchmarkFrames);
+    fprintf(out, "\t\"allocations_per_frame\": %.2f,\n\t\"allocating_frames\": %ld,\n\t\"max_allocations_per_frame\": %ld,\n",
+        (double)allocations / benchmarkFrames, frameAllocations.allocatingFrames, frameAllocations.maxPerFrame);
+    WriteAllocationSizes(out, "allocation_sizes", sizes);
+    WriteAllocationSizes(out, "max_frame_allocation_sizes", frameAllocations.maxFrameSizes);
+    if (resolution.Active())
+        fprintf(out, "\t\"resolution_scale\": %.3f,\n\t\"resolution_changes\": %ld,\n", resolution.Scale(), resolution.Changes());
+    frame.Write(out, "frame_ms");
+    fprintf(out, ",\n");
+    submission.Write(out, "submission_ms");
+    fprintf(out, ",\n");
+    gpu.Write(out, "gpu_ms");
+    fprintf(out, "\n}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+// after onInitialization: the replay and the frame benchmark end the program here, the interactive run goes on
+void StartRun() {
+    if ((frameTimeBudget > 0 || fixedResolution > 0) && !resolution.Start(windowWidth, windowHeight, frameTimeBudget, fixedResolution))
+        exit(1);
+    if (captureFile && !capture.Start(captureFile, windowWidth, windowHeight)) exit(1);
+    if (inputLog.Replaying()) exit(RunReplay());
+
+    if (benchmarkFrames > 0) {
+        char scene[256];
+        sprintf(scene, "\"objects\": %d, \"points\": %d, \"mobius_on_gpu\": %s, \"incremental\": %s",
+                nObjects, nPoints, mobiusOnGpu ? "true" : "false", incrementalAnimation ? "true" : "false");
+        exit(RunFrameBenchmark("complex transformation", scene));
+    }
+#if !defined(__APPLE__)
+    glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);    // so that onExit is called
+#endif
+}
+
+// options of glutInit and the number of their arguments, -1 if the option is not one of them
+int GlutOptionArguments(const char * option) {
+    if (strcmp(option, "-display") == 0) return 1;
+    const char * flags[] = { "-direct", "-indirect", "-iconic", "-gldebug", "-sync" };
+    for (int i = 0; i < 5; i++) if (strcmp(option, flags[i]) == 0) return 0;
+    return -1;
+}
+
+// The options are read before glutInit, which gets the same arguments and takes its own options from them:
+//   -microbench [file.json]          microbenchmarks of the math core without a window, must be the first
+//   -objects n                       number of objects
+//   -points n                        points per object
+//   -benchmark frames [-json file]   frame benchmark instead of the interactive run
+//   -capture name.ppm | name.rgba    capture the frames into images or a raw video stream
+//   -frametime ms | -resolution scale dynamic resolution within a GPU time budget, or a fixed one
+//   -record file | -replay file      record the input events, or replay them without a window loop
+//   -geometry file                   points and colours of the objects from a binary geometry file
+//   -savegeometry file               save the polygon of -points points as a geometry file and exit
+//   -vertexformat float|half|fixed16 GPU storage of the untransformed points, fixed16 by default
+//   -upload strategy                 bufferdata, orphan, subdata, mapinvalidate, mapunsynchronized or
+//                                    persistent update of the transformed points, measured by default
+//   -uploadbench file.json           measure the upload strategies and exit
+void ParseOptions(int argc, char * argv[]) {
+    if (argc > 1 && strcmp(argv[1], "-microbench") == 0) exit(RunMicroBenchmarks(argc > 2 ? argv[2] : NULL));
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        int glutArguments = GlutOptionArguments(argv[i]);
+        if (glutArguments >= 0) i += glutArguments - 1;     // left for glutInit
+        else if (strcmp(argv[i], "-objects") == 0) nObjects = std::max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "-points") == 0) nPoints = std::max(3, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "-benchmark") == 0) benchmarkFrames = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-json") == 0) benchmarkFile = argv[i + 1];
+        else if (strcmp(argv[i], "-capture") == 0) captureFile = argv[i + 1];
+        else if (strcmp(argv[i], "-frametime") == 0) frameTimeBudget = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-resolution") == 0) fixedResolution = (float)atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-upload") == 0) {
+            for (int s = 0; s < UPLOAD_STRATEGIES; s++) if (strcmp(argv[i + 1], uploadStrategyNames[s]) == 0) uploadStrategy = s;
+            if (uploadStrategy < 0) printf("Unknown upload strategy %s\n", argv[i + 1]);
+        } else if (strcmp(argv[i], "-uploadbench") == 0) uploadBenchmarkFile = argv[i + 1];
+        else if (strcmp(argv[i], "-vertexformat") == 0) {
+            if (strcmp(argv[i + 1], "float") == 0) staticPositionFormat = POSITION_FLOAT;
+            else if (strcmp(argv[i + 1], "half") == 0) staticPositionFormat = POSITION_HALF;
+            else if (strcmp(argv[i + 1], "fixed16") == 0) staticPositionFormat = POSITION_FIXED16;
+            else printf("Unknown vertex format %s\n", argv[i + 1]);
+        } else if (strcmp(argv[i], "-geometry") == 0) {
+            if (!geometry.Open(argv[i + 1])) exit(1);
+        } else if (strcmp(argv[i], "-savegeometry") == 0) {
+            std::vector<Complex> positions;
+            std::vector<float> colors;
+            for (int k = 0; k < nPoints; k++) {
+                float phi = 2 * (float)M_PI * k / nPoints;
+                positions.push_back(Polar(1.0f, phi));
+                colors.push_back(0.5f + 0.5f * cosf(phi));
+                colors.push_back(0.5f + 0.5f * cosf(phi - 2.094f));
+                colors.push_back(0.5f + 0.5f * cosf(phi + 2.094f));
+            }
+            exit(GeometryFile::Write(argv[i + 1], positions, colors) ? 0 : 1);
+        }
+        else if (strcmp(argv[i], "-record") == 0 || strcmp(argv[i], "-replay") == 0) {
+            if (!inputLog.Open(argv[i + 1], strcmp(argv[i], "-replay") == 0)) exit(1);
+        }
+        else printf("Unknown option %s\n", argv[i]);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    ParseOptions(argc, argv);                   // runs without a window exit here
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Do not touch the code below this line
 
-int main(int argc, char * argv[]) {
     glutInit(&argc, argv);
 #if !defined(__APPLE__)
     glutInitContextVersion(majorVersion, minorVersion);
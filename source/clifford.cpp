@@ -5,8 +5,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <ctype.h>
+#include <string.h>
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SINCOS_SIMD		// AVX2 and AVX-512 kernels compiled with target attributes, chosen at run time
+#include <immintrin.h>
+#endif
 
 #include <vector>
+#include <map>
+#include <string>
+#include <tuple>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <type_traits>
+#include <chrono>
+#include <deque>
+#include <new>
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -19,12 +37,106 @@
 #include <GL/glew.h>		// must be downloaded 
 #include <GL/freeglut.h>	// must be downloaded unless you have an Apple
 #endif
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 const unsigned int windowWidth = 600, windowHeight = 600;
 
+// Each program of the repository is one file, the skeleton project builds a single source. The allocation
+// counters, ShaderProgram, FastSinCos, Pack4 and mat4T, ThreadPool, MappedFile, FixedStep, FrameIntervals,
+// InputLog, FrameCapture, DynamicResolution and the benchmark harness are the same as in
+// "Transzformci komplex szmokkal.cpp", so a change to one of them goes into both files.
+
 // OpenGL major and minor versions
 int majorVersion = 3, minorVersion = 3;
 
+// number of heap allocations since the start, counted by the replaced global operator new, and their
+// sizes: class c counts the allocations of (2^(c-1), 2^c] bytes
+std::atomic<long> allocationCount(0);
+const int ALLOCATION_SIZE_CLASSES = 48;
+std::atomic<long> allocationSizes[ALLOCATION_SIZE_CLASSES];
+
+int AllocationSizeClass(size_t size) {
+	int c = 0;
+	while (c < ALLOCATION_SIZE_CLASSES - 1 && ((size_t)1 << c) < size) c++;
+	return c;
+}
+
+// kept out of line, so the compiler does not pair the free of an inlined delete with the new of the caller
+#if defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+NOINLINE void * operator new(size_t size) {
+	allocationCount++;
+	allocationSizes[AllocationSizeClass(size)]++;
+	void * p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+NOINLINE void * operator new[](size_t size) { return operator new(size); }
+NOINLINE void operator delete(void * p) noexcept { free(p); }
+NOINLINE void operator delete[](void * p) noexcept { free(p); }
+NOINLINE void operator delete(void * p, size_t) noexcept { free(p); }		// sized forms, so every deallocation matches
+NOINLINE void operator delete[](void * p, size_t) noexcept { free(p); }
+
+// heap allocations of the frames, EndFrame is called at the end of every onDisplay
+struct FrameAllocationCounter {
+	long frameStart;		// allocationCount at the start of the current frame
+	long frames, allocatingFrames, maxPerFrame;
+	long sizesStart[ALLOCATION_SIZE_CLASSES];		// allocationSizes at the start of the current frame
+	long frameSizes[ALLOCATION_SIZE_CLASSES];		// size classes of the last finished frame
+	long maxFrameSizes[ALLOCATION_SIZE_CLASSES];	// size classes of the frame with the most allocations
+
+	FrameAllocationCounter() { Restart(); }
+
+	void Restart() {
+		frameStart = allocationCount;
+		frames = allocatingFrames = maxPerFrame = 0;
+		for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) {
+			sizesStart[c] = allocationSizes[c];
+			frameSizes[c] = maxFrameSizes[c] = 0;
+		}
+	}
+
+	void EndFrame() {
+		long now = allocationCount, allocations = now - frameStart;
+		frameStart = now;
+		for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) {
+			long sizes = allocationSizes[c];
+			frameSizes[c] = sizes - sizesStart[c];
+			sizesStart[c] = sizes;
+		}
+		frames++;
+		if (allocations > 0) allocatingFrames++;
+		if (allocations > maxPerFrame) {
+			maxPerFrame = allocations;
+			for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) maxFrameSizes[c] = frameSizes[c];
+		}
+	}
+};
+
+FrameAllocationCounter frameAllocations;
+
+// a size class histogram as a JSON object, keyed by the upper bound of the class in bytes
+void WriteAllocationSizes(FILE * out, const char * name, const long * sizes) {
+	fprintf(out, "\t\"%s\": {", name);
+	const char * separator = " ";
+	for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) {
+		if (sizes[c] == 0) continue;
+		fprintf(out, "%s\"%llu\": %ld", separator, 1ULL << c, sizes[c]);
+		separator = ", ";
+	}
+	fprintf(out, " },\n");
+}
+
+
 void getErrorInfo(unsigned int handle) {
 	int logLen;
 	glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &logLen);
@@ -33,7 +145,7 @@ void getErrorInfo(unsigned int handle) {
 		int written;
 		glGetShaderInfoLog(handle, logLen, &written, log);
 		printf("Shader log:\n%s", log);
-		delete log;
+		delete[] log;
 	}
 }
 
@@ -57,17 +169,99 @@ void checkLinking(unsigned int program) {
 	}
 }
 
+// extensions have to be queried one by one in the core profile
+bool ExtensionSupported(const char * name) {
+	int n = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+	for (int i = 0; i < n; i++)
+		if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name) == 0) return true;
+	return false;
+}
+
+// lets the driver compile shaders on its own threads, so that compiling does not block the application
+void EnableParallelShaderCompile() {
+#if !defined(__APPLE__)
+	typedef void (GLAPIENTRY * MaxShaderCompilerThreadsProc)(GLuint count);
+	MaxShaderCompilerThreadsProc maxThreads = NULL;
+	if (ExtensionSupported("GL_KHR_parallel_shader_compile"))
+		maxThreads = (MaxShaderCompilerThreadsProc)glutGetProcAddress("glMaxShaderCompilerThreadsKHR");
+	else if (GLEW_ARB_parallel_shader_compile)
+		maxThreads = glMaxShaderCompilerThreadsARB;
+	if (maxThreads) maxThreads(0xFFFFFFFF);		// as many threads as the implementation likes
+#endif
+}
+
+// Shader program whose compilation and linking are only issued by Create. The driver works on them while
+// the application uploads geometry, and the status is checked when the program is first used.
+class ShaderProgram {
+	unsigned int program, vertexShader, fragmentShader;
+	bool checked;
+
+	static unsigned int CreateShader(GLenum type, const char * source, const char * name) {
+		unsigned int shader = glCreateShader(type);
+		if (!shader) {
+			printf("Error in %s shader creation\n", name);
+			exit(1);
+		}
+		glShaderSource(shader, 1, &source, NULL);
+		glCompileShader(shader);
+		return shader;
+	}
+public:
+	ShaderProgram() { program = vertexShader = fragmentShader = 0; checked = false; }
+
+	unsigned int Create(const char * vertexSource, const char * fragmentSource, const char * fragmentOutput) {
+		vertexShader = CreateShader(GL_VERTEX_SHADER, vertexSource, "vertex");
+		fragmentShader = CreateShader(GL_FRAGMENT_SHADER, fragmentSource, "fragment");
+
+		// Attach shaders to a single program
+		program = glCreateProgram();
+		if (!program) {
+			printf("Error in shader program creation\n");
+			exit(1);
+		}
+		glAttachShader(program, vertexShader);
+		glAttachShader(program, fragmentShader);
+
+		// Connect the fragmentColor to the frame buffer memory
+		glBindFragDataLocation(program, 0, fragmentOutput);	// fragmentColor goes to the frame buffer memory
+
+		glLinkProgram(program);		// program packaging, not waited for
+		checked = false;
+		return program;
+	}
+
+	// makes this program run, the first time it waits for the compilation and reports the errors
+	void Use() {
+		if (!checked) {
+			checkShader(vertexShader, "Vertex shader error");
+			checkShader(fragmentShader, "Fragment shader error");
+			checkLinking(program);
+			glDeleteShader(vertexShader);	// the program keeps them while it exists
+			glDeleteShader(fragmentShader);
+			checked = true;
+		}
+		glUseProgram(program);
+	}
+
+	unsigned int Id() const { return program; }
+};
+
 // vertex shader in GLSL
 const char * vertexSource = R"(
 	#version 330
     precision highp float;
 
 	uniform mat4 MVP;			// View-Projection matrix in row-major format
-    uniform vec2 point, tangent;
 
 	layout(location = 0) in vec2 vertexPosition;	// Attrib Array 0
+	layout(location = 1) in float pointX;			// Attrib Arrays 1-4: placement, per instance
+	layout(location = 2) in float pointY;			// when drawing many vehicles, otherwise
+	layout(location = 3) in float tangentX;			// constant attribute values
+	layout(location = 4) in float tangentY;
 
 	void main() {
+		vec2 point = vec2(pointX, pointY), tangent = vec2(tangentX, tangentY);
 		vec2 normal = vec2(-tangent.y, tangent.x);
 		vec2 p = vertexPosition.x * tangent + vertexPosition.y * normal + point; 
 		gl_Position = vec4(p.x, p.y, 0, 1) * MVP; 		// transform to clipping space
@@ -87,23 +281,251 @@ const char * fragmentSource = R"(
 	}
 )";
 
+// Closed polylines expanded to wide lines: vertex 6 s .. 6 s + 5 is a quad around segment s, it reads the
+// segment end points and the neighboring points from a buffer texture, the vehicle placement is the same as
+// in vertexSource.
+const char * lineVertexSource = R"(
+	#version 330
+    precision highp float;
+
+	uniform mat4 MVP;
+	uniform samplerBuffer points;	// vec2 per texel
+	uniform int first, count;		// the polyline in points, the last point is connected to the first
+	uniform vec4 viewport;			// x, y, width, height in pixels
+	uniform float halfWidth;		// in pixels
+
+	layout(location = 1) in float pointX;
+	layout(location = 2) in float pointY;
+	layout(location = 3) in float tangentX;
+	layout(location = 4) in float tangentY;
+
+	flat out vec2 start, end;		// the segment in window coordinates
+	flat out vec2 before, after;	// the point before start and after end, the neighboring segments end there
+	flat out int neighbors;			// 0 for polylines of less than 3 points, whose segments are not distinct
+
+	vec2 Window(vec2 p, vec2 point, vec2 tangent) {
+		vec2 normal = vec2(-tangent.y, tangent.x);
+		vec4 clip = vec4(p.x * tangent + p.y * normal + point, 0, 1) * MVP;
+		return viewport.xy + (clip.xy / clip.w * 0.5 + 0.5) * viewport.zw;
+	}
+
+	void main() {
+		int segment = gl_VertexID / 6, corner = gl_VertexID % 6;
+		vec2 point = vec2(pointX, pointY), tangent = vec2(tangentX, tangentY);
+		start = Window(texelFetch(points, first + segment).xy, point, tangent);
+		end = Window(texelFetch(points, first + (segment + 1) % count).xy, point, tangent);
+		before = Window(texelFetch(points, first + (segment + count - 1) % count).xy, point, tangent);
+		after = Window(texelFetch(points, first + (segment + 2) % count).xy, point, tangent);
+		neighbors = count >= 3 ? 1 : 0;
+
+		vec2 direction = end - start;
+		float l = length(direction);
+		direction = l > 0 ? direction / l : vec2(1, 0);
+		vec2 side = vec2(-direction.y, direction.x);
+		float extent = halfWidth + 1;	// the coverage falls to zero within a pixel
+		bool atEnd = corner == 1 || corner == 2 || corner == 4;
+		float across = (corner == 0 || corner == 1 || corner == 3) ? -1 : 1;
+		vec2 p = (atEnd ? end + direction * extent : start - direction * extent) + side * (across * extent);
+		gl_Position = vec4((p - viewport.xy) / viewport.zw * 2 - 1, 0, 1);
+	}
+)";
+
+// coverage from the distance to the segment: round joins and caps, anti-aliased over one pixel. The quads of
+// neighboring segments overlap at the joins, so a pixel there is drawn only by the nearer segment, by the
+// earlier one at equal distance, otherwise it would be blended twice.
+const char * lineFragmentSource = R"(
+	#version 330
+    precision highp float;
+
+	uniform vec4 color;
+	uniform float halfWidth;
+	flat in vec2 start, end, before, after;
+	flat in int neighbors;
+	out vec4 fragmentColor;
+
+	float Distance(vec2 q, vec2 a, vec2 b) {
+		vec2 p = q - a, d = b - a;
+		float t = clamp(dot(p, d) / max(dot(d, d), 1e-12), 0, 1);
+		return length(p - t * d);
+	}
+
+	void main() {
+		float distance = Distance(gl_FragCoord.xy, start, end);
+		if (neighbors != 0 && (Distance(gl_FragCoord.xy, before, start) <= distance || Distance(gl_FragCoord.xy, end, after) < distance)) discard;
+		float coverage = clamp(halfWidth + 0.5 - distance, 0, 1);
+		fragmentColor = vec4(color.rgb, color.a * coverage);
+	}
+)";
+
+//---------------------------------------------------------------------------------------------
+// Sine and cosine of the same angle together: Cody-Waite reduction by pi/4 and the minimax
+// polynomials of Cephes sinf/cosf. Error against the double precision result for |x| <= 8192:
+// at most 2 ULP for results above 2^-10 in magnitude, and below 2^-33 absolute error near the zeros.
+// Larger arguments and NaN go to the C library. The AVX2 and AVX-512 versions perform the
+// same operations in the same order on 8 and 16 lanes, so they have the same error bounds
+// (the scalar tail may differ in the last bit if the compiler contracts it to FMA instructions).
+// They are compiled for their instruction sets whatever the build flags are, and the batch
+// function picks the widest one the processor supports when it is first called.
+//---------------------------------------------------------------------------------------------
+const float SINCOS_LIMIT = 8192.0f;
+const float SINCOS_4_PI = 1.27323954473516f;		// 4 / pi
+const float SINCOS_DP1 = 0.78515625f, SINCOS_DP2 = 2.4187564849853515625e-4f, SINCOS_DP3 = 3.77489497744594108e-8f;
+const float SIN_C0 = -1.9515295891e-4f, SIN_C1 = 8.3321608736e-3f, SIN_C2 = -1.6666654611e-1f;
+const float COS_C0 = 2.443315711809948e-5f, COS_C1 = -1.388731625493765e-3f, COS_C2 = 4.166664568298827e-2f;
+
+inline void FastSinCos(float x, float& s, float& c) {
+	float ax = fabsf(x);
+	if (!(ax <= SINCOS_LIMIT)) {
+		s = sinf(x); c = cosf(x);
+		return;
+	}
+	int j = (int)(ax * SINCOS_4_PI);
+	j = (j + 1) & ~1;									// octant pair, the angle is reduced to [-pi/4, pi/4]
+	float y = (float)j;
+	float z = ((ax - y * SINCOS_DP1) - y * SINCOS_DP2) - y * SINCOS_DP3;
+	float zz = z * z;
+	float ps = ((SIN_C0 * zz + SIN_C1) * zz + SIN_C2) * zz * z + z;
+	float pc = ((COS_C0 * zz + COS_C1) * zz + COS_C2) * zz * zz - 0.5f * zz + 1.0f;
+	bool swap = (j & 2) != 0;
+	s = swap ? pc : ps;
+	c = swap ? ps : pc;
+	if (((j & 4) != 0) != (x < 0)) s = -s;
+	if ((j + 2) & 4) c = -c;
+}
+
+#if defined(SINCOS_SIMD)
+// zero masked forms where the plain intrinsic passes an undefined source register, which GCC warns about
+#define ALL16 ((__mmask16)0xffff)
+__attribute__((target("avx512f"))) void FastSinCos16(const float * x, float * s, float * c) {
+	__m512 vx = _mm512_loadu_ps(x);
+	__m512i signBit = _mm512_set1_epi32(0x80000000);
+	__m512 ax = _mm512_castsi512_ps(_mm512_and_si512(_mm512_set1_epi32(0x7fffffff), _mm512_castps_si512(vx)));
+	if (_mm512_cmp_ps_mask(ax, _mm512_set1_ps(SINCOS_LIMIT), _CMP_NLE_UQ)) {	// some lanes for the C library
+		for (int i = 0; i < 16; i++) FastSinCos(x[i], s[i], c[i]);
+		return;
+	}
+	__m512i j = _mm512_maskz_cvttps_epi32(ALL16, _mm512_mul_ps(ax, _mm512_set1_ps(SINCOS_4_PI)));
+	j = _mm512_and_si512(_mm512_add_epi32(j, _mm512_set1_epi32(1)), _mm512_set1_epi32(~1));
+	__m512 y = _mm512_maskz_cvtepi32_ps(ALL16, j);
+	__m512 z = _mm512_sub_ps(ax, _mm512_mul_ps(y, _mm512_set1_ps(SINCOS_DP1)));
+	z = _mm512_sub_ps(z, _mm512_mul_ps(y, _mm512_set1_ps(SINCOS_DP2)));
+	z = _mm512_sub_ps(z, _mm512_mul_ps(y, _mm512_set1_ps(SINCOS_DP3)));
+	__m512 zz = _mm512_mul_ps(z, z);
+	__m512 ps = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(SIN_C0), zz), _mm512_set1_ps(SIN_C1));
+	ps = _mm512_add_ps(_mm512_mul_ps(ps, zz), _mm512_set1_ps(SIN_C2));
+	ps = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(ps, zz), z), z);
+	__m512 pc = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(COS_C0), zz), _mm512_set1_ps(COS_C1));
+	pc = _mm512_add_ps(_mm512_mul_ps(pc, zz), _mm512_set1_ps(COS_C2));
+	pc = _mm512_sub_ps(_mm512_mul_ps(_mm512_mul_ps(pc, zz), zz), _mm512_mul_ps(_mm512_set1_ps(0.5f), zz));
+	pc = _mm512_add_ps(pc, _mm512_set1_ps(1.0f));
+	__mmask16 swap = _mm512_test_epi32_mask(j, _mm512_set1_epi32(2));
+	__m512i sv = _mm512_castps_si512(_mm512_mask_blend_ps(swap, ps, pc));
+	__m512i cv = _mm512_castps_si512(_mm512_mask_blend_ps(swap, pc, ps));
+	__m512i sinSign = _mm512_xor_si512(_mm512_maskz_slli_epi32(ALL16, _mm512_and_si512(j, _mm512_set1_epi32(4)), 29),
+	                                   _mm512_and_si512(_mm512_castps_si512(vx), signBit));
+	__m512i cosSign = _mm512_maskz_slli_epi32(ALL16, _mm512_and_si512(_mm512_add_epi32(j, _mm512_set1_epi32(2)), _mm512_set1_epi32(4)), 29);
+	_mm512_storeu_ps(s, _mm512_castsi512_ps(_mm512_xor_si512(sv, sinSign)));
+	_mm512_storeu_ps(c, _mm512_castsi512_ps(_mm512_xor_si512(cv, cosSign)));
+}
+
+__attribute__((target("avx2"))) void FastSinCos8(const float * x, float * s, float * c) {
+	__m256 vx = _mm256_loadu_ps(x);
+	__m256 signBit = _mm256_set1_ps(-0.0f);
+	__m256 ax = _mm256_andnot_ps(signBit, vx);
+	if (_mm256_movemask_ps(_mm256_cmp_ps(ax, _mm256_set1_ps(SINCOS_LIMIT), _CMP_NLE_UQ))) {	// some lanes for the C library
+		for (int i = 0; i < 8; i++) FastSinCos(x[i], s[i], c[i]);
+		return;
+	}
+	__m256i j = _mm256_cvttps_epi32(_mm256_mul_ps(ax, _mm256_set1_ps(SINCOS_4_PI)));
+	j = _mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+	__m256 y = _mm256_cvtepi32_ps(j);
+	__m256 z = _mm256_sub_ps(ax, _mm256_mul_ps(y, _mm256_set1_ps(SINCOS_DP1)));
+	z = _mm256_sub_ps(z, _mm256_mul_ps(y, _mm256_set1_ps(SINCOS_DP2)));
+	z = _mm256_sub_ps(z, _mm256_mul_ps(y, _mm256_set1_ps(SINCOS_DP3)));
+	__m256 zz = _mm256_mul_ps(z, z);
+	__m256 ps = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(SIN_C0), zz), _mm256_set1_ps(SIN_C1));
+	ps = _mm256_add_ps(_mm256_mul_ps(ps, zz), _mm256_set1_ps(SIN_C2));
+	ps = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(ps, zz), z), z);
+	__m256 pc = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(COS_C0), zz), _mm256_set1_ps(COS_C1));
+	pc = _mm256_add_ps(_mm256_mul_ps(pc, zz), _mm256_set1_ps(COS_C2));
+	pc = _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(pc, zz), zz), _mm256_mul_ps(_mm256_set1_ps(0.5f), zz));
+	pc = _mm256_add_ps(pc, _mm256_set1_ps(1.0f));
+	__m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)), _mm256_set1_epi32(2)));
+	__m256 sv = _mm256_blendv_ps(ps, pc, swap), cv = _mm256_blendv_ps(pc, ps, swap);
+	__m256 sinSign = _mm256_xor_ps(_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(4)), 29)),
+	                               _mm256_and_ps(vx, signBit));
+	__m256 cosSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(2)), _mm256_set1_epi32(4)), 29));
+	_mm256_storeu_ps(s, _mm256_xor_ps(sv, sinSign));
+	_mm256_storeu_ps(c, _mm256_xor_ps(cv, cosSign));
+}
+#endif
+
+// lanes of the widest kernel the processor can run, 1: the scalar one
+int SinCosLanes() {
+#if defined(SINCOS_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return 16;
+	if (__builtin_cpu_supports("avx2")) return 8;
+#endif
+	return 1;
+}
+
+// n angles, the output arrays may be the input array
+void FastSinCos(const float * x, float * s, float * c, int n) {
+	static const int lanes = SinCosLanes();
+	int i = 0;
+#if defined(SINCOS_SIMD)
+	if (lanes == 16) for (; i + 16 <= n; i += 16) FastSinCos16(x + i, s + i, c + i);
+	if (lanes >= 8) for (; i + 8 <= n; i += 8) FastSinCos8(x + i, s + i, c + i);
+#endif
+	for (; i < n; i++) FastSinCos(x[i], s[i], c[i]);
+}
+
+// pack of 4 floats processed together, the loops are mapped to SSE/NEON instructions by the compiler
+struct Pack4 {
+	alignas(16) float v[4];
+	Pack4(float a = 0) { v[0] = v[1] = v[2] = v[3] = a; }
+	Pack4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+	float& operator[](int i) { return v[i]; }
+	float operator[](int i) const { return v[i]; }
+	Pack4& operator+=(const Pack4& r) { for (int i = 0; i < 4; i++) v[i] += r.v[i]; return *this; }
+	Pack4& operator-=(const Pack4& r) { for (int i = 0; i < 4; i++) v[i] -= r.v[i]; return *this; }
+	Pack4& operator*=(const Pack4& r) { for (int i = 0; i < 4; i++) v[i] *= r.v[i]; return *this; }
+	Pack4& operator/=(const Pack4& r) { for (int i = 0; i < 4; i++) v[i] /= r.v[i]; return *this; }
+};
+
+inline Pack4 operator+(Pack4 l, const Pack4& r) { return l += r; }
+inline Pack4 operator-(Pack4 l, const Pack4& r) { return l -= r; }
+inline Pack4 operator*(Pack4 l, const Pack4& r) { return l *= r; }
+inline Pack4 operator/(Pack4 l, const Pack4& r) { return l /= r; }
+inline Pack4 operator-(const Pack4& a) { return Pack4(-a.v[0], -a.v[1], -a.v[2], -a.v[3]); }
+inline Pack4 sin(const Pack4& a) { Pack4 s, c; FastSinCos(a.v, s.v, c.v, 4); return s; }
+inline Pack4 cos(const Pack4& a) { Pack4 s, c; FastSinCos(a.v, s.v, c.v, 4); return c; }
+inline Pack4 sqrt(const Pack4& a) { return Pack4(sqrtf(a.v[0]), sqrtf(a.v[1]), sqrtf(a.v[2]), sqrtf(a.v[3])); }
+
+// The math types are templates of the scalar type (float, double or Pack4),
+// the names without T are the float versions used for the GPU
+
 // row-major matrix 4x4
-struct mat4 {
-	float m[4][4];
+template<class T> struct mat4T {
+	T m[4][4];
 public:
-	mat4() {}
-	mat4(float m00, float m01, float m02, float m03,
-		float m10, float m11, float m12, float m13,
-		float m20, float m21, float m22, float m23,
-		float m30, float m31, float m32, float m33) {
+	mat4T() {}
+	mat4T(T m00, T m01, T m02, T m03,
+		T m10, T m11, T m12, T m13,
+		T m20, T m21, T m22, T m23,
+		T m30, T m31, T m32, T m33) {
 		m[0][0] = m00; m[0][1] = m01; m[0][2] = m02; m[0][3] = m03;
 		m[1][0] = m10; m[1][1] = m11; m[1][2] = m12; m[1][3] = m13;
 		m[2][0] = m20; m[2][1] = m21; m[2][2] = m22; m[2][3] = m23;
 		m[3][0] = m30; m[3][1] = m31; m[3][2] = m32; m[3][3] = m33;
 	}
+	template<class U> explicit mat4T(const mat4T<U>& r) {	// change of precision
+		for (int i = 0; i < 4; i++) for (int j = 0; j < 4; j++) m[i][j] = r.m[i][j];
+	}
 
-	mat4 operator*(const mat4& right) {
-		mat4 result;
+	mat4T operator*(const mat4T& right) {
+		mat4T result;
 		for (int i = 0; i < 4; i++) {
 			for (int j = 0; j < 4; j++) {
 				result.m[i][j] = 0;
@@ -112,31 +534,49 @@ public:
 		}
 		return result;
 	}
-	operator float*() { return &m[0][0]; }
+	operator T*() { return &m[0][0]; }
 };
 
+typedef mat4T<float> mat4;
 
 // 2D point in homogeneous coordinates
-struct vec2 {
-	float x, y;
-	vec2(float x0 = 0, float y0 = 0) { x = x0; y = y0; }
+template<class T> struct vec2T {
+	T x, y;
+	vec2T(T x0 = 0, T y0 = 0) { x = x0; y = y0; }
+	template<class U> explicit vec2T(const vec2T<U>& v) { x = v.x; y = v.y; }
 };
 
+typedef vec2T<float> vec2;
+
 // 2D point in homogeneous coordinates
-struct vec4 {
-	float x, y, z, w;
-	vec4(float x0 = 0, float y0 = 0, float z0 = 0, float w0 = 0) { x = x0; y = y0; z = z0; w = w0; }
+template<class T> struct vec4T {
+	T x, y, z, w;
+	vec4T(T x0 = 0, T y0 = 0, T z0 = 0, T w0 = 0) { x = x0; y = y0; z = z0; w = w0; }
+	template<class U> explicit vec4T(const vec4T<U>& v) { x = v.x; y = v.y; z = v.z; w = v.w; }
 };
 
+typedef vec4T<float> vec4;
+
+// sine and cosine of a scalar, float and Pack4 use the FastSinCos kernel
+template<class S> inline void SinCosOf(S t, S& s, S& c) { s = sin(t); c = cos(t); }
+inline void SinCosOf(float t, float& s, float& c) { FastSinCos(t, s, c); }
+inline void SinCosOf(const Pack4& t, Pack4& s, Pack4& c) { FastSinCos(t.v, s.v, c.v, 4); }
+
 // 2D camera
 struct Camera {
 	float wCx, wCy;	// center in world coordinates
 	float wWx, wWy;	// width and height in world coordinates
+	float viewCx, viewCy, viewWx, viewWy;	// view that Animate returns to, set by the scene
 public:
 	Camera() {
+		SetView(0, 0, 10, 10);
 		Animate(0);
 	}
 
+	void SetView(float cx, float cy, float wx, float wy) {
+		viewCx = cx; viewCy = cy; viewWx = wx; viewWy = wy;
+	}
+
 	mat4 V() { // view matrix: translates the center to the origin
 		return mat4(1,    0, 0, 0,
 			        0,    1, 0, 0,
@@ -166,223 +606,2616 @@ public:
 	}
 
 	void Animate(float t) {
-		wCx = 0;
-		wCy = 0;
-		wWx = 10;
-		wWy = 10;
+		wCx = viewCx;
+		wCy = viewCy;
+		wWx = viewWx;
+		wWy = viewWy;
 	}
 };
 
 // 2D camera
 Camera camera;
 
-// handle of the shader program
-unsigned int shaderProgram;
+// handle of the shader programs: 1 pixel line loops, and polylines expanded to wide lines on the GPU
+ShaderProgram gpuProgram, lineProgram;
+unsigned int shaderProgram;		// the one in use
+float lineWidth = 2;			// in pixels, 0: 1 pixel line loops, set on the command line
+
+// Buffer texture over a vbo of n vec2 points for the wide lines, 0 if they are off. Falls back to line loops
+// for all drawing if the buffer is larger than what a buffer texture can address.
+unsigned int CreatePointTexture(unsigned int vbo, int n) {
+	if (lineWidth <= 0) return 0;
+	int maxTexels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	if (n > maxTexels) {
+		printf("%d points do not fit into a buffer texture of %d texels, lines are 1 pixel wide\n", n, maxTexels);
+		lineWidth = 0;
+		return 0;
+	}
+	unsigned int texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_BUFFER, texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32F, vbo);
+	return texture;
+}
 
-struct Clifford {
-	float f, d;
-	Clifford(float f0 = 0, float d0 = 0) { f = f0, d = d0; }
-	Clifford operator+(Clifford r) { return Clifford(f + r.f, d + r.d); }
-	Clifford operator-(Clifford r) { return Clifford(f - r.f, d - r.d); }
-	Clifford operator*(Clifford r) { return Clifford(f * r.f, f * r.d + d * r.f); }
-	Clifford operator/(Clifford r) {
-		float l = r.f * r.f;
-		return (*this) * Clifford(r.f / l, -r.d / l);
+// closed polyline of count points from first of the point texture, instances times with the bound vao
+void DrawLineLoop(unsigned int texture, int first, int count, int instances) {
+	if (lineWidth <= 0) {
+		glDrawArraysInstanced(GL_LINE_LOOP, first, count, instances);
+		return;
 	}
+	int viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	int location = glGetUniformLocation(shaderProgram, "viewport");
+	if (location >= 0) glUniform4f(location, (float)viewport[0], (float)viewport[1], (float)viewport[2], (float)viewport[3]);
+	location = glGetUniformLocation(shaderProgram, "halfWidth");
+	if (location >= 0) glUniform1f(location, lineWidth / 2);
+	location = glGetUniformLocation(shaderProgram, "first");
+	if (location >= 0) glUniform1i(location, first);
+	location = glGetUniformLocation(shaderProgram, "count");
+	if (location >= 0) glUniform1i(location, count);
+	location = glGetUniformLocation(shaderProgram, "points");
+	if (location >= 0) glUniform1i(location, 0);	// texture unit 0
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, texture);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, 6 * count, instances);
+}
 
-	Clifford static T(float t) { return Clifford(t, 1); }
-	Clifford static Sin(float t) { return Clifford(sin(t), cos(t)); }
-	Clifford static Cos(float t) { return Clifford(cos(t), -sin(t)); }
+//---------------------------------------------------------------------------------------------
+// Expression templates: operators on CliffordExpr only build a tree of small nodes, assigning it
+// to a Clifford evaluates the whole expression in one inlined pass computing f and d together,
+// so + - * / of Clifford numbers create no temporaries
+//---------------------------------------------------------------------------------------------
+template<class E> struct CliffordExpr {
+	constexpr const E& self() const { return static_cast<const E&>(*this); }
+};
+
+template<class S> struct CliffordT : CliffordExpr<CliffordT<S> > {	// S: scalar type
+	typedef S Scalar;
+	S f, d;
+	constexpr CliffordT(S f0 = 0, S d0 = 0) : f(f0), d(d0) { }
+	template<class E> constexpr CliffordT(const CliffordExpr<E>& e,	// evaluates an expression template of the same precision
+		typename std::enable_if<std::is_same<typename E::Scalar, S>::value>::type * = 0) : CliffordT(e.self().eval()) { }
+	template<class U> explicit constexpr CliffordT(const CliffordT<U>& c) : f(c.f), d(c.d) { }	// change of precision
+	constexpr CliffordT eval() const { return *this; }
+
+	CliffordT static T(Scalar t) { return CliffordT(t, 1); }
+	CliffordT static Sin(Scalar t) { Scalar s, c; SinCosOf(t, s, c); return CliffordT(s, c); }
+	CliffordT static Cos(Scalar t) { Scalar s, c; SinCosOf(t, s, c); return CliffordT(c, -s); }
 
 };
-/*
-void Path(float t, Clifford& x, Clifford& y) {
-	x = Clifford::Sin(t) * (Clifford::Sin(t) + 3) * 3 / (Clifford::Sin(t) + 2);
-	y = (Clifford::Cos(t) * 4 + 1) / (Clifford::Sin(t) + 2);
-}
-*/
 
-void Path(float t, Clifford& x, Clifford& y) {
-	float r = 3.0f;
-	x = Clifford::Sin(t) * r;
-	y = Clifford::Cos(t) * r;
+typedef CliffordT<float> Clifford;
+
+// Clifford::Sin(t[i]) and Clifford::Cos(t[i]) of n parameters with the vectorized kernel, either output may be NULL
+void CliffordSinCos(const float * t, int n, Clifford * sin, Clifford * cos) {
+	const int CHUNK = 64;
+	float s[CHUNK], c[CHUNK];
+	for (int base = 0; base < n; base += CHUNK) {
+		int m = std::min(CHUNK, n - base);
+		FastSinCos(t + base, s, c, m);
+		for (int i = 0; i < m; i++) {
+			if (sin) sin[base + i] = Clifford(s[i], c[i]);
+			if (cos) cos[base + i] = Clifford(c[i], -s[i]);
+		}
+	}
 }
 
-class Object {
-	unsigned int vao;	// vertex array object id
-	int nPoints;
-	vec4 color;
-public:
+template<class A, class B> struct CliffordSum : CliffordExpr<CliffordSum<A, B> > {
+	typedef typename A::Scalar Scalar;
+	typedef CliffordT<Scalar> C;
+	A a; B b;
+	constexpr CliffordSum(const A& a0, const B& b0) : a(a0), b(b0) { }
+	constexpr C eval() const { return Add(a.eval(), b.eval()); }
+	static constexpr C Add(C l, C r) { return C(l.f + r.f, l.d + r.d); }
+};
 
-	Object(std::vector<vec2>& points, vec4 color0) {
-		color = color0;
-		nPoints = points.size();
+template<class A, class B> struct CliffordDifference : CliffordExpr<CliffordDifference<A, B> > {
+	typedef typename A::Scalar Scalar;
+	typedef CliffordT<Scalar> C;
+	A a; B b;
+	constexpr CliffordDifference(const A& a0, const B& b0) : a(a0), b(b0) { }
+	constexpr C eval() const { return Sub(a.eval(), b.eval()); }
+	static constexpr C Sub(C l, C r) { return C(l.f - r.f, l.d - r.d); }
+};
 
-		glGenVertexArrays(1, &vao);	// create 1 vertex array object
-		glBindVertexArray(vao);		// make it active
-		unsigned int vbo;		// vertex buffer objects
-		glGenBuffers(1, &vbo);	// Generate 1 vertex buffer objects
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		// Map Attribute Array 0 to the current bound vertex buffer (vbo[0])
+template<class A, class B> struct CliffordProduct : CliffordExpr<CliffordProduct<A, B> > {
+	typedef typename A::Scalar Scalar;
+	typedef CliffordT<Scalar> C;
+	A a; B b;
+	constexpr CliffordProduct(const A& a0, const B& b0) : a(a0), b(b0) { }
+	constexpr C eval() const { return Mul(a.eval(), b.eval()); }
+	static constexpr C Mul(C l, C r) { return C(l.f * r.f, l.f * r.d + l.d * r.f); }
+};
 
-		glBufferData(GL_ARRAY_BUFFER,      // copy to the GPU
-			points.size() * sizeof(vec2), // number of the vbo in bytes
-			points.data(),		   // address of the data array on the CPU
-			GL_STATIC_DRAW);	   // copy to GPU
+template<class A, class B> struct CliffordQuotient : CliffordExpr<CliffordQuotient<A, B> > {
+	typedef typename A::Scalar Scalar;
+	typedef CliffordT<Scalar> C;
+	A a; B b;
+	constexpr CliffordQuotient(const A& a0, const B& b0) : a(a0), b(b0) { }
+	constexpr C eval() const { return Div(a.eval(), b.eval()); }
+	static constexpr C Div(C l, C r) { return Reciprocal(l, r, Scalar(1) / r.f); }
+	static constexpr C Reciprocal(C l, C r, Scalar inv) {	// (l/r)' = (l' - (l/r) r') / r
+		return C(l.f * inv, (l.d - l.f * inv * r.d) * inv);
+	}
+};
 
-		glEnableVertexAttribArray(0); 
-		// Data organization of Attribute Array 0 
-		glVertexAttribPointer(0,			// Attribute Array 0
-			                  2, GL_FLOAT,  // components/attribute, component type
-							  GL_FALSE,		// not in fixed point format, do not normalized
-							  0, NULL);     // stride and offset: it is tightly packed
+// scale * a + shift with a scalar scale and shift, covers the mixed Clifford-scalar operators
+template<class A> struct CliffordAffine : CliffordExpr<CliffordAffine<A> > {
+	typedef typename A::Scalar Scalar;
+	typedef CliffordT<Scalar> C;
+	A a; Scalar scale, shift;
+	constexpr CliffordAffine(const A& a0, Scalar scale0, Scalar shift0) : a(a0), scale(scale0), shift(shift0) { }
+	constexpr C eval() const { return Apply(a.eval(), scale, shift); }
+	static constexpr C Apply(C l, Scalar scale, Scalar shift) { return C(l.f * scale + shift, l.d * scale); }
+};
+
+template<class A, class B> constexpr CliffordSum<A, B> operator+(const CliffordExpr<A>& a, const CliffordExpr<B>& b) {
+	return CliffordSum<A, B>(a.self(), b.self());
+}
+template<class A, class B> constexpr CliffordDifference<A, B> operator-(const CliffordExpr<A>& a, const CliffordExpr<B>& b) {
+	return CliffordDifference<A, B>(a.self(), b.self());
+}
+template<class A, class B> constexpr CliffordProduct<A, B> operator*(const CliffordExpr<A>& a, const CliffordExpr<B>& b) {
+	return CliffordProduct<A, B>(a.self(), b.self());
+}
+template<class A, class B> constexpr CliffordQuotient<A, B> operator/(const CliffordExpr<A>& a, const CliffordExpr<B>& b) {
+	return CliffordQuotient<A, B>(a.self(), b.self());
+}
+template<class A> constexpr CliffordAffine<A> operator+(const CliffordExpr<A>& a, typename A::Scalar c) { return CliffordAffine<A>(a.self(), 1, c); }
+template<class A> constexpr CliffordAffine<A> operator+(typename A::Scalar c, const CliffordExpr<A>& a) { return CliffordAffine<A>(a.self(), 1, c); }
+template<class A> constexpr CliffordAffine<A> operator-(const CliffordExpr<A>& a, typename A::Scalar c) { return CliffordAffine<A>(a.self(), 1, -c); }
+template<class A> constexpr CliffordAffine<A> operator-(typename A::Scalar c, const CliffordExpr<A>& a) { return CliffordAffine<A>(a.self(), -1, c); }
+template<class A> constexpr CliffordAffine<A> operator*(const CliffordExpr<A>& a, typename A::Scalar c) { return CliffordAffine<A>(a.self(), c, 0); }
+template<class A> constexpr CliffordAffine<A> operator*(typename A::Scalar c, const CliffordExpr<A>& a) { return CliffordAffine<A>(a.self(), c, 0); }
+template<class A> constexpr CliffordAffine<A> operator/(const CliffordExpr<A>& a, typename A::Scalar c) {
+	return CliffordAffine<A>(a.self(), typename A::Scalar(1) / c, 0);
+}
+template<class A> constexpr CliffordQuotient<CliffordT<typename A::Scalar>, A> operator/(typename A::Scalar c, const CliffordExpr<A>& a) {
+	return CliffordQuotient<CliffordT<typename A::Scalar>, A>(CliffordT<typename A::Scalar>(c), a.self());
+}
+
+// Sin(t) and Cos(t) of the same parameter from a single sine-cosine evaluation
+template<class T> struct SinCosT {
+	CliffordT<T> sin, cos;
+	SinCosT(T t) {
+		T s, c;
+		SinCosOf(t, s, c);
+		sin = CliffordT<T>(s, c);
+		cos = CliffordT<T>(c, -s);
 	}
+};
 
-	void Draw( vec2 point, vec2 tangent ) {
-		mat4 MVPTransform = camera.V() * camera.P();
+typedef SinCosT<float> SinCos;
+/*
+void Path(float t, Clifford& x, Clifford& y) {
+	SinCos sc(t);
+	x = sc.sin * (sc.sin + 3) * 3 / (sc.sin + 2);
+	y = (sc.cos * 4 + 1) / (sc.sin + 2);
+}
+*/
 
-		// set GPU uniform matrix variable MVP with the content of CPU variable MVPTransform
-		int location = glGetUniformLocation(shaderProgram, "MVP");
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVPTransform); // set uniform variable MVP to the MVPTransform
-		else printf("uniform MVP cannot be set\n");
+//---------------------------------------------------------------------------------------------
+// Reverse mode automatic differentiation: operations on Var are recorded on a tape and a single
+// backward sweep gives the derivatives of a result by every parameter
+//---------------------------------------------------------------------------------------------
+struct TapeNode {
+	int a, b;		// operand nodes, -1 for constants
+	double da, db;	// partial derivatives of the node by its operands
+};
 
-		location = glGetUniformLocation(shaderProgram, "point");
-		if (location >= 0) glUniform2f(location, point.x, point.y);
+struct Var {
+	float f;	// value
+	int i;		// node on the tape, -1 for constants
+	Var(float f0 = 0, int i0 = -1) { f = f0; i = i0; }
 
-		location = glGetUniformLocation(shaderProgram, "tangent");
-		if (location >= 0) glUniform2f(location, tangent.x, tangent.y);
+	Var static Parameter(float value);		// independent variable
+	Var static Sin(Var x);
+	Var static Cos(Var x);
 
-		location = glGetUniformLocation(shaderProgram, "color");
-		if (location >= 0) glUniform4f(location, color.x, color.y, color.z, color.w);
+	int static Record(Var x, double dx);
+	int static Record(Var x, double dx, Var y, double dy);
+};
 
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_LINE_LOOP, 0, nPoints);	// draw a single triangle with vertices defined in vao
+// Arena of one gradient evaluation: Reset keeps the memory, so after the first evaluation neither the records
+// nor the independent variables allocate. onDisplay resets it at the end of every frame.
+class Tape {
+	std::vector<TapeNode> nodes;
+	std::vector<double> adjoints;	// double, the sums over hundreds of parameters keep their precision
+	std::vector<Var> variables;		// independent variables of the evaluation
+public:
+	Tape() { nodes.reserve(4096); }
+
+	int Push(int a, double da, int b = -1, double db = 0) {
+		TapeNode node = { a, b, da, db };
+		nodes.push_back(node);
+		return nodes.size() - 1;
 	}
 
-	void Animate(float t) {
-		Clifford x, y;
-		Path(t, x, y);
-		float tangentLength = sqrt(x.d * x.d + y.d * y.d);		// tangentLength == v
-		vec2 tangent(x.d / tangentLength, y.d / tangentLength);		// tangent == it
-		Draw(vec2(x.f, y.f), tangent);
+	// room for n independent variables, valid until the next Variables or Reset
+	Var * Variables(int n) {
+		variables.resize(n);
+		return variables.data();
 	}
 
-};
+	// backward sweep from the output node, afterwards Adjoint(i) is d output / d node i
+	void Backward(int output) {
+		adjoints.assign(nodes.size(), 0.0);
+		if (output < 0) return;
+		adjoints[output] = 1;
+		for (int i = output; i >= 0; i--) {
+			double adjoint = adjoints[i];
+			if (adjoint == 0) continue;
+			const TapeNode& node = nodes[i];
+			if (node.a >= 0) adjoints[node.a] += node.da * adjoint;
+			if (node.b >= 0) adjoints[node.b] += node.db * adjoint;
+		}
+	}
 
+	double Adjoint(int i) const { return (i >= 0 && i < (int)adjoints.size()) ? adjoints[i] : 0; }
+	int Size() const { return nodes.size(); }
+	void Reset() {
+		nodes.clear();
+		variables.clear();
+	}
+};
 
-// The virtual world: collection of two objects
-Object * vehicle;
-Object * path;
+// shared tape, every gradient evaluation starts with Reset
+Tape tape;
 
-// Initialization, create an OpenGL context
-void onInitialization() {
-	glViewport(0, 0, windowWidth, windowHeight);
+inline Var Var::Parameter(float value) { return Var(value, tape.Push(-1, 0)); }
+inline Var Var::Sin(Var x) { float s, c; FastSinCos(x.f, s, c); return Var(s, Record(x, c)); }
+inline Var Var::Cos(Var x) { float s, c; FastSinCos(x.f, s, c); return Var(c, Record(x, -s)); }
 
-	std::vector<vec2> points;
-	points.push_back(vec2(-1, -1));
-	points.push_back(vec2(1, 0));
-	points.push_back(vec2(-1, 1));
-	points.push_back(vec2(0, 0));
+inline int Var::Record(Var x, double dx) { return (x.i < 0) ? -1 : tape.Push(x.i, dx); }
+inline int Var::Record(Var x, double dx, Var y, double dy) {
+	if (x.i < 0) return Record(y, dy);
+	if (y.i < 0) return Record(x, dx);
+	return tape.Push(x.i, dx, y.i, dy);
+}
 
-	vec4 color = vec4(1, 1, 0, 1);
-	vehicle = new Object(points, color);
+inline Var operator+(Var x, Var y) { return Var(x.f + y.f, Var::Record(x, 1, y, 1)); }
+inline Var operator-(Var x, Var y) { return Var(x.f - y.f, Var::Record(x, 1, y, -1)); }
+inline Var operator*(Var x, Var y) { return Var(x.f * y.f, Var::Record(x, y.f, y, x.f)); }
+inline Var operator/(Var x, Var y) {
+	double inv = 1.0 / y.f;
+	return Var((float)(x.f * inv), Var::Record(x, inv, y, -x.f * inv * inv));
+}
+inline Var operator+(Var x, float c) { return x + Var(c); }
+inline Var operator+(float c, Var x) { return Var(c) + x; }
+inline Var operator-(Var x, float c) { return x - Var(c); }
+inline Var operator-(float c, Var x) { return Var(c) - x; }
+inline Var operator*(Var x, float c) { return x * Var(c); }
+inline Var operator*(float c, Var x) { return Var(c) * x; }
+inline Var operator/(Var x, float c) { return x / Var(c); }
+inline Var operator/(float c, Var x) { return Var(c) / x; }
+
+// gradient of y by the parameters, one backward sweep independently of their number
+void Gradient(Var y, const Var * parameters, int n, std::vector<float>& gradient) {
+	tape.Backward(y.i);
+	gradient.resize(n);
+	for (int k = 0; k < n; k++) gradient[k] = (float)tape.Adjoint(parameters[k].i);
+}
 
-	std::vector<vec2> pathPoints;
-	for (float t = 0; t < 2.0f * M_PI; t += 0.1f) {
-		Clifford x, y;
-		Path(t, x, y);								//minden pontban irnymenti derivlt szmts
-		pathPoints.push_back(vec2(x.f, y.f));
+//---------------------------------------------------------------------------------------------
+// Parametric path giving the derivative by the parameter together with the position
+//---------------------------------------------------------------------------------------------
+struct Curve {
+	virtual void Eval(const float * t, int n, float * xf, float * xd, float * yf, float * yd) const = 0;
+	virtual float Period() const { return 2.0f * M_PI; }	// parameter range of one round
+	virtual ~Curve() { }
+
+	// double parameters for long paths, where a float would quantize the position; rounded to float by default
+	virtual void Eval(const double * t, int n, float * xf, float * xd, float * yf, float * yd) const {
+		float block[64];
+		for (int base = 0; base < n; base += 64) {
+			int m = std::min(64, n - base);
+			for (int k = 0; k < m; k++) block[k] = (float)t[base + k];
+			Eval(block, m, xf + base, xd + base, yf + base, yd + base);
+		}
 	}
-	color = vec4(1, 1, 1, 1);
-	path = new Object(pathPoints, color);
 
-	// Create vertex shader from string
-	unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	if (!vertexShader) {
-		printf("Error in vertex shader creation\n");
-		exit(1);
-	}
-	glShaderSource(vertexShader, 1, &vertexSource, NULL);
-	glCompileShader(vertexShader);
-	checkShader(vertexShader, "Vertex shader error");
+	void Eval(float t, Clifford& x, Clifford& y) const { Eval(&t, 1, &x.f, &x.d, &y.f, &y.d); }
+	void Eval(double t, Clifford& x, Clifford& y) const { Eval(&t, 1, &x.f, &x.d, &y.f, &y.d); }
+};
 
-	// Create fragment shader from string
-	unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	if (!fragmentShader) {
-		printf("Error in fragment shader creation\n");
-		exit(1);
+//---------------------------------------------------------------------------------------------
+// Path expression language, e.g. "x = sin(t)*(sin(t)+3)*3/(sin(t)+2); y = (cos(t)*4+1)/(sin(t)+2)"
+// compiled to register bytecode and evaluated on structure of arrays Clifford lanes
+//---------------------------------------------------------------------------------------------
+enum OpCode : int { OP_CONST, OP_T, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG, OP_SIN, OP_COS, OP_SQRT,
+              OP_SINCOS, OP_COSINE,		// sin(a) and cos(a) from one FastSinCos, OP_COSINE is filled by the OP_SINCOS before it
+              OP_ADDC, OP_MULC, OP_RSUBC, OP_RDIVC };	// a + c, a * c, c - a, c / a with the constant c in value
+
+struct Instruction {
+	OpCode op;
+	int a, b;		// source registers, the result goes to the register of the instruction's own index
+	float value;	// value of OP_CONST, constant operand of OP_ADDC .. OP_RDIVC
+	Instruction(OpCode op0, int a0, int b0, float value0) { op = op0; a = a0; b = b0; value = value0; }
+};
+static_assert(sizeof(Instruction) == 16, "Instruction is stored in scene files");
+
+class PathProgram : public Curve {
+	static const int LANES = 64;				// parameters evaluated together, registers of a block stay in L1
+	std::vector<Instruction> code;
+	const Instruction * program;				// code, or bytecode in a mapped scene file
+	size_t programSize;
+	std::map<std::string, int> variables;		// named registers, x and y are the outputs
+	std::map<std::tuple<int, int, int, unsigned int>, int> emitted;	// common subexpression elimination, constants by bit pattern
+	int xReg, yReg;
+	const char * src;							// parser cursor
+	bool failed;
+
+	int Fail(const char * message) {
+		if (!failed) printf("Path syntax error: %s at \"%.20s\"\n", message, src);
+		failed = true;
+		return -1;
 	}
-	glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-	glCompileShader(fragmentShader);
-	checkShader(fragmentShader, "Fragment shader error");
 
-	// Attach shaders to a single program
-	shaderProgram = glCreateProgram();
-	if (!shaderProgram) {
-		printf("Error in shader program creation\n");
-		exit(1);
+	bool IsConst(int r) { return r >= 0 && code[r].op == OP_CONST; }
+
+	int Emit(OpCode op, int a = -1, int b = -1, float value = 0) {
+		if (op != OP_CONST && op != OP_T && IsConst(a) && (b < 0 || IsConst(b))) {	// constant folding
+			float x = code[a].value, y = (b >= 0) ? code[b].value : 0;
+			switch (op) {
+			case OP_ADD: value = x + y; break;
+			case OP_SUB: value = x - y; break;
+			case OP_MUL: value = x * y; break;
+			case OP_DIV: value = x / y; break;
+			case OP_NEG: value = -x; break;
+			case OP_SIN: value = sinf(x); break;
+			case OP_COS: value = cosf(x); break;
+			case OP_SQRT: value = sqrtf(x); break;
+			default: break;
+			}
+			op = OP_CONST; a = b = -1;
+		}
+		if (op == OP_SIN || op == OP_COS) {		// FastSinCos gives both, so they are always emitted as a pair
+			int r = Emit(OP_SINCOS, a);
+			return (op == OP_SIN) ? r : r + 1;
+		}
+		if (op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_DIV) {	// a constant operand goes into the instruction
+			if (IsConst(b)) {
+				float c = code[b].value;
+				if (op == OP_ADD || op == OP_SUB) { value = (op == OP_ADD) ? c : -c; op = OP_ADDC; }
+				else { value = (op == OP_MUL) ? c : 1 / c; op = OP_MULC; }
+				b = -1;
+			} else if (IsConst(a)) {
+				value = code[a].value;
+				op = (op == OP_ADD) ? OP_ADDC : (op == OP_MUL) ? OP_MULC : (op == OP_SUB) ? OP_RSUBC : OP_RDIVC;
+				a = b; b = -1;
+			}
+		}
+		if ((op == OP_ADD || op == OP_MUL) && a > b) std::swap(a, b);	// commutative: canonical order
+		unsigned int bits;
+		memcpy(&bits, &value, sizeof(bits));	// a float key would break on NaN, which is not equal to itself
+		std::tuple<int, int, int, unsigned int> key(op, a, b, bits);
+		std::map<std::tuple<int, int, int, unsigned int>, int>::iterator it = emitted.find(key);
+		if (it != emitted.end()) return it->second;
+		code.push_back(Instruction(op, a, b, value));
+		if (op == OP_SINCOS) code.push_back(Instruction(OP_COSINE, a, -1, 0));
+		return emitted[key] = code.size() - (op == OP_SINCOS ? 2 : 1);
 	}
-	glAttachShader(shaderProgram, vertexShader);
-	glAttachShader(shaderProgram, fragmentShader);
 
-	// Connect the fragmentColor to the frame buffer memory
-	glBindFragDataLocation(shaderProgram, 0, "fragmentColor");	// fragmentColor goes to the frame buffer memory
+	void SkipSpaces() { while (*src == ' ' || *src == '\t' || *src == '\r') src++; }
 
-	// program packaging
-	glLinkProgram(shaderProgram);
-	checkLinking(shaderProgram);
-	// make this program run
-	glUseProgram(shaderProgram);
-}
+	bool Accept(char c) {
+		SkipSpaces();
+		if (*src != c) return false;
+		src++;
+		return true;
+	}
 
-void onExit() {
-	glDeleteProgram(shaderProgram);
-	printf("exit");
-}
+	std::string Identifier() {
+		SkipSpaces();
+		const char * start = src;
+		while (isalnum((unsigned char)*src) || *src == '_') src++;
+		return std::string(start, src);
+	}
 
-// Window has become invalid: Redraw
-void onDisplay() {
-	glClearColor(0, 0, 0, 0);								// background color 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);		// clear the screen
-	path -> Draw(vec2(0, 0), vec2(1, 0));
-	
-	long time = glutGet(GLUT_ELAPSED_TIME);					// elapsed time since the start of the program
-	float sec = time / 1000.0f;								// convert msec to sec
-	printf("time = %f\n", sec);
-	vehicle->Animate(sec);
+	int Primary() {
+		SkipSpaces();
+		if (isdigit((unsigned char)*src) || *src == '.') {
+			char * end;
+			float value = strtof(src, &end);
+			src = end;
+			return Emit(OP_CONST, -1, -1, value);
+		}
+		if (Accept('(')) {
+			int r = Expression();
+			if (!Accept(')')) return Fail("missing )");
+			return r;
+		}
+		std::string name = Identifier();
+		if (name.empty()) return Fail("unexpected character");
+		if (name == "t") return Emit(OP_T);
+		if (name == "pi") return Emit(OP_CONST, -1, -1, (float)M_PI);
+		if (name == "sin" || name == "cos" || name == "sqrt") {
+			if (!Accept('(')) return Fail("missing (");
+			int r = Expression();
+			if (!Accept(')')) return Fail("missing )");
+			if (r < 0) return r;
+			return Emit(name == "sin" ? OP_SIN : (name == "cos" ? OP_COS : OP_SQRT), r);
+		}
+		std::map<std::string, int>::iterator it = variables.find(name);
+		if (it == variables.end()) return Fail("undefined variable");
+		return it->second;
+	}
 
-	glutSwapBuffers();										// exchange the two buffers
-}
+	int Unary() {
+		if (Accept('-')) {
+			int r = Unary();
+			return (r < 0) ? r : Emit(OP_NEG, r);
+		}
+		return Primary();
+	}
 
-// Key of ASCII code pressed
-void onKeyboard(unsigned char key, int pX, int pY) {
-	if (key == 'd') glutPostRedisplay();         // if d, invalidate display, i.e. redraw
-}
+	int Term() {
+		int r = Unary();
+		for (;;) {
+			OpCode op;
+			if (Accept('*')) op = OP_MUL;
+			else if (Accept('/')) op = OP_DIV;
+			else return r;
+			int r2 = Unary();
+			if (r < 0 || r2 < 0) return -1;
+			r = Emit(op, r, r2);
+		}
+	}
 
-// Key of ASCII code released
-void onKeyboardUp(unsigned char key, int pX, int pY) {
+	int Expression() {
+		int r = Term();
+		for (;;) {
+			OpCode op;
+			if (Accept('+')) op = OP_ADD;
+			else if (Accept('-')) op = OP_SUB;
+			else return r;
+			int r2 = Term();
+			if (r < 0 || r2 < 0) return -1;
+			r = Emit(op, r, r2);
+		}
+	}
 
-}
+public:
+	PathProgram() { xReg = yReg = -1; failed = false; src = ""; program = NULL; programSize = 0; }
+
+	// statements "name = expression" separated by ; or new line
+	bool Compile(const char * source) {
+		code.clear(); variables.clear(); emitted.clear();
+		program = NULL; programSize = 0;
+		failed = false;
+		src = source;
+		for (;;) {
+			while (Accept(';') || Accept('\n'));
+			if (*src == '\0') break;
+			std::string name = Identifier();
+			if (name.empty() || name == "t") { Fail("variable name expected"); return false; }
+			if (!Accept('=')) { Fail("missing ="); return false; }
+			int r = Expression();
+			if (r < 0) return false;
+			variables[name] = r;
+			SkipSpaces();
+			if (*src != ';' && *src != '\n' && *src != '\0') { Fail("unexpected character"); return false; }
+		}
+		if (variables.find("x") == variables.end() || variables.find("y") == variables.end()) {
+			printf("Path program must define x and y\n");
+			return false;
+		}
+		xReg = variables["x"];
+		yReg = variables["y"];
+		program = code.data();
+		programSize = code.size();
+		return true;
+	}
 
-// Mouse click event
-void onMouse(int button, int state, int pX, int pY) {
-	if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {  // GLUT_LEFT_BUTTON / GLUT_RIGHT_BUTTON and GLUT_DOWN / GLUT_UP
+	// runs compiled bytecode where it is, e.g. in a mapped file, after checking that every operand
+	// is an earlier register and every OP_SINCOS is followed by its OP_COSINE
+	bool Attach(const Instruction * instructions, int count, int x, int y) {
+		code.clear(); variables.clear(); emitted.clear();
+		program = NULL; programSize = 0;
+		if (count <= 0 || x < 0 || x >= count || y < 0 || y >= count) return false;
+		for (int r = 0; r < count; r++) {
+			const Instruction& in = instructions[r];
+			if ((unsigned int)in.op > OP_RDIVC || in.a >= r || in.b >= r || in.a < -1 || in.b < -1) return false;
+			bool binary = in.op == OP_ADD || in.op == OP_SUB || in.op == OP_MUL || in.op == OP_DIV;
+			bool operand = in.op != OP_CONST && in.op != OP_T;
+			if ((operand && in.a < 0) || (binary && in.b < 0) || in.op == OP_SIN || in.op == OP_COS) return false;
+			if (in.op == OP_SINCOS && (r + 1 >= count || instructions[r + 1].op != OP_COSINE || instructions[r + 1].a != in.a)) return false;
+			if (in.op == OP_COSINE && (r == 0 || instructions[r - 1].op != OP_SINCOS)) return false;
+		}
+		program = instructions;
+		programSize = count;
+		xReg = x; yReg = y;
+		return true;
 	}
-}
 
-// Move mouse with key pressed
-void onMouseMotion(int pX, int pY) {
-}
+	const Instruction * Code() const { return program; }
+	int XRegister() const { return xReg; }
+	int YRegister() const { return yReg; }
+
+	// evaluates n parameters, the results are the values and derivatives of x and y in separate arrays
+	void Eval(const float * t, int n, float * xf, float * xd, float * yf, float * yd) const {
+		static thread_local std::vector<float> registers;
+		registers.resize(programSize * 2 * LANES);
+		for (size_t r = 0; r < programSize; r++) {		// constant registers do not change between the blocks
+			if (program[r].op != OP_CONST) continue;
+			std::fill(&registers[r * 2 * LANES], &registers[r * 2 * LANES] + LANES, program[r].value);
+			std::fill(&registers[r * 2 * LANES] + LANES, &registers[r * 2 * LANES] + 2 * LANES, 0.0f);
+		}
+		for (int base = 0; base < n; base += LANES) {
+			int m = std::min(LANES, n - base);		// a shorter last block repeats its last parameter, the loops have a fixed length
+			for (size_t r = 0; r < programSize; r++) {
+				const Instruction& in = program[r];
+				float * __restrict f = &registers[r * 2 * LANES], * __restrict d = f + LANES;	// never an operand of itself
+				const float * af = NULL, * ad = NULL, * bf = NULL, * bd = NULL;
+				if (in.a >= 0) { af = &registers[in.a * 2 * LANES]; ad = af + LANES; }
+				if (in.b >= 0) { bf = &registers[in.b * 2 * LANES]; bd = bf + LANES; }
+				float c = in.value;
+				switch (in.op) {
+				case OP_CONST: case OP_COSINE: case OP_SIN: case OP_COS: break;	// filled before the blocks or by OP_SINCOS, OP_SIN and OP_COS are not emitted
+				case OP_T:     for (int i = 0; i < LANES; i++) { f[i] = t[base + std::min(i, m - 1)]; d[i] = 1; } break;
+				case OP_ADD:   for (int i = 0; i < LANES; i++) { f[i] = af[i] + bf[i]; d[i] = ad[i] + bd[i]; } break;
+				case OP_SUB:   for (int i = 0; i < LANES; i++) { f[i] = af[i] - bf[i]; d[i] = ad[i] - bd[i]; } break;
+				case OP_MUL:   for (int i = 0; i < LANES; i++) { f[i] = af[i] * bf[i]; d[i] = af[i] * bd[i] + ad[i] * bf[i]; } break;
+				case OP_DIV:
+					for (int i = 0; i < LANES; i++) {
+						float inv = 1 / bf[i];
+						f[i] = af[i] * inv;
+						d[i] = (ad[i] - f[i] * bd[i]) * inv;
+					}
+					break;
+				case OP_NEG:   for (int i = 0; i < LANES; i++) { f[i] = -af[i]; d[i] = -ad[i]; } break;
+				case OP_SQRT:  for (int i = 0; i < LANES; i++) { f[i] = sqrtf(af[i]); d[i] = ad[i] / (2 * f[i]); } break;
+				case OP_SINCOS: {
+					float * cf = d + LANES, * cd = cf + LANES;	// register of the OP_COSINE
+					FastSinCos(af, f, cf, LANES);
+					for (int i = 0; i < LANES; i++) { d[i] = cf[i] * ad[i]; cd[i] = -f[i] * ad[i]; }
+					break;
+				}
+				case OP_ADDC:  for (int i = 0; i < LANES; i++) { f[i] = af[i] + c; d[i] = ad[i]; } break;
+				case OP_MULC:  for (int i = 0; i < LANES; i++) { f[i] = af[i] * c; d[i] = ad[i] * c; } break;
+				case OP_RSUBC: for (int i = 0; i < LANES; i++) { f[i] = c - af[i]; d[i] = -ad[i]; } break;
+				case OP_RDIVC:
+					for (int i = 0; i < LANES; i++) {
+						float inv = 1 / af[i];
+						f[i] = c * inv;
+						d[i] = -f[i] * ad[i] * inv;
+					}
+					break;
+				}
+			}
+			for (int i = 0; i < m; i++) {
+				xf[base + i] = registers[xReg * 2 * LANES + i]; xd[base + i] = registers[xReg * 2 * LANES + LANES + i];
+				yf[base + i] = registers[yReg * 2 * LANES + i]; yd[base + i] = registers[yReg * 2 * LANES + LANES + i];
+			}
+		}
+	}
+
+	using Curve::Eval;
+
+	int Size() const { return (int)programSize; }
+};
+
+//---------------------------------------------------------------------------------------------
+// Piecewise cubic paths on uniform knots: segment i covers the parameters [i, i+1), so finding
+// the segment is a floor, and the precomputed coefficients are evaluated with the Horner scheme
+//---------------------------------------------------------------------------------------------
+class SplinePath : public Curve {
+	// x(u) = ((ax u + bx) u + cx) u + dx in segment i, structure of arrays for sequential access;
+	// the 8 arrays follow each other in coefficients, or in a mapped scene file
+	std::vector<float> coefficients;
+	const float * ax, * bx, * cx, * dx, * ay, * by, * cy, * dy;
+	int segments;
+	bool closed;
+
+	void SetArrays(const float * c, int segments0) {
+		segments = segments0;
+		ax = c; bx = ax + segments; cx = bx + segments; dx = cx + segments;
+		ay = dx + segments; by = ay + segments; cy = by + segments; dy = cy + segments;
+	}
+protected:
+	// coefficients of every segment from the basis matrix applied to 4 consecutive control points,
+	// stride is the number of control points between the first points of neighboring segments
+	void Build(const std::vector<vec2>& cps, const float basis[4][4], int stride, bool closed0) {
+		closed = closed0;
+		int n = cps.size();
+		int count = closed ? n / stride : (n - 4) / stride + 1;
+		if (n < 4) count = 0;
+		coefficients.assign(8 * count, 0.0f);
+		SetArrays(coefficients.data(), count);
+		for (int i = 0; i < segments; i++) {
+			float px[4], py[4];
+			for (int k = 0; k < 4; k++) {
+				const vec2& p = cps[(i * stride + k) % n];
+				px[k] = p.x; py[k] = p.y;
+			}
+			for (int r = 0; r < 4; r++) {		// ax bx cx dx, then ay by cy dy
+				coefficients[r * segments + i] = basis[r][0] * px[0] + basis[r][1] * px[1] + basis[r][2] * px[2] + basis[r][3] * px[3];
+				coefficients[(4 + r) * segments + i] = basis[r][0] * py[0] + basis[r][1] * py[1] + basis[r][2] * py[2] + basis[r][3] * py[3];
+			}
+		}
+	}
+
+public:
+	SplinePath() { SetArrays(NULL, 0); closed = true; }
+
+	// uses the 8 coefficient arrays of the segments where they are, e.g. in a mapped file
+	bool Attach(const float * c, int segments0, bool closed0) {
+		coefficients.clear();
+		SetArrays(segments0 > 0 ? c : NULL, std::max(segments0, 0));
+		closed = closed0;
+		return segments > 0;
+	}
+
+	int Segments() const { return segments; }
+	float Period() const { return segments; }
+	const float * Coefficients() const { return ax; }
+	bool Closed() const { return closed; }
+
+	// the segment index and the local parameter u are separated in the precision of the parameter,
+	// so a double parameter keeps u exact in paths of millions of segments
+	template<class T> void EvalSegments(const T * t, int n, float * xf, float * xd, float * yf, float * yd) const {
+		if (segments == 0) return;
+		for (int k = 0; k < n; k++) {
+			T s = closed ? t[k] - segments * floor(t[k] / segments) : std::min(std::max(t[k], (T)0), (T)segments);
+			int i = (int)s;
+			if (i >= segments) i = segments - 1;	// end of an open path or rounding
+			float u = (float)(s - i);
+			xf[k] = ((ax[i] * u + bx[i]) * u + cx[i]) * u + dx[i];
+			xd[k] = (3 * ax[i] * u + 2 * bx[i]) * u + cx[i];
+			yf[k] = ((ay[i] * u + by[i]) * u + cy[i]) * u + dy[i];
+			yd[k] = (3 * ay[i] * u + 2 * by[i]) * u + cy[i];
+		}
+	}
+	void Eval(const float * t, int n, float * xf, float * xd, float * yf, float * yd) const { EvalSegments(t, n, xf, xd, yf, yd); }
+	void Eval(const double * t, int n, float * xf, float * xd, float * yf, float * yd) const { EvalSegments(t, n, xf, xd, yf, yd); }
+	using Curve::Eval;
+};
+
+// interpolates the control points, the tangent at a point is half the vector between its neighbors
+class CatmullRomPath : public SplinePath {
+public:
+	CatmullRomPath(const std::vector<vec2>& cps, bool closed = true) {
+		const float basis[4][4] = { { -0.5f,  1.5f, -1.5f,  0.5f },
+		                            {  1.0f, -2.5f,  2.0f, -0.5f },
+		                            { -0.5f,  0.0f,  0.5f,  0.0f },
+		                            {  0.0f,  1.0f,  0.0f,  0.0f } };
+		Build(cps, basis, 1, closed);
+	}
+};
+
+// segments of 4 control points sharing their end points: p0 p1 p2 p3 p4 p5 p6 ...
+class BezierPath : public SplinePath {
+public:
+	BezierPath(const std::vector<vec2>& cps) {
+		const float basis[4][4] = { { -1,  3, -3, 1 },
+		                            {  3, -6,  3, 0 },
+		                            { -3,  3,  0, 0 },
+		                            {  1,  0,  0, 0 } };
+		Build(cps, basis, 3, false);
+	}
+};
+
+// uniform cubic B-spline, C2 continuous but only approximates the control points
+class BSplinePath : public SplinePath {
+public:
+	BSplinePath(const std::vector<vec2>& cps, bool closed = true) {
+		const float basis[4][4] = { { -1 / 6.0f,  3 / 6.0f, -3 / 6.0f, 1 / 6.0f },
+		                            {  3 / 6.0f, -6 / 6.0f,  3 / 6.0f, 0 },
+		                            { -3 / 6.0f,  0,         3 / 6.0f, 0 },
+		                            {  1 / 6.0f,  4 / 6.0f,  1 / 6.0f, 0 } };
+		Build(cps, basis, 1, closed);
+	}
+};
+
+// control points from a text file of "x y" lines
+bool LoadControlPoints(const char * fileName, std::vector<vec2>& cps) {
+	FILE * file = fopen(fileName, "r");
+	if (!file) {
+		printf("Cannot open control point file %s\n", fileName);
+		return false;
+	}
+	float x, y;
+	while (fscanf(file, "%f %f", &x, &y) == 2) cps.push_back(vec2(x, y));
+	fclose(file);
+	return cps.size() >= 4;
+}
+
+//---------------------------------------------------------------------------------------------
+// Fitting a closed Catmull-Rom path to another path, the gradient of the error by all the
+// control point coordinates comes from one backward sweep of the tape
+//---------------------------------------------------------------------------------------------
+// mean squared distance between the samples of the target and the spline at the same fraction of the round,
+// instantiated with Var for the gradient and with float for the line search and the finite differences
+template<class T>
+T SplineFitError(const T * px, const T * py, int n, const std::vector<vec2>& target) {
+	int m = target.size();
+	T error = 0;
+	for (int k = 0; k < m; k++) {
+		float s = (float)n * k / m;
+		int i = (int)s;
+		float u = s - i;
+		// weights of the control points i..i+3 in segment i, the columns of the basis of CatmullRomPath
+		float w0 = ((-0.5f * u + 1.0f) * u - 0.5f) * u, w1 = (1.5f * u - 2.5f) * u * u + 1;
+		float w2 = ((-1.5f * u + 2.0f) * u + 0.5f) * u, w3 = (0.5f * u - 0.5f) * u * u;
+		int i1 = (i + 1) % n, i2 = (i + 2) % n, i3 = (i + 3) % n;
+		T dx = w0 * px[i] + w1 * px[i1] + w2 * px[i2] + w3 * px[i3] - target[k].x;
+		T dy = w0 * py[i] + w1 * py[i1] + w2 * py[i2] + w3 * py[i3] - target[k].y;
+		error = error + dx * dx + dy * dy;
+	}
+	return error / (float)m;
+}
+
+template<class T> T SplineFitError(const std::vector<T>& px, const std::vector<T>& py, const std::vector<vec2>& target) {
+	return SplineFitError(&px[0], &py[0], px.size(), target);
+}
+
+// error and gradient by x0 .. xn-1, y0 .. yn-1 of the control points, the variables are kept on the tape
+float SplineFitGradient(const std::vector<float>& px, const std::vector<float>& py, const std::vector<vec2>& target,
+                        std::vector<float>& gradient) {
+	int n = px.size();
+	tape.Reset();
+	Var * v = tape.Variables(2 * n);
+	for (int j = 0; j < n; j++) v[j] = Var::Parameter(px[j]);
+	for (int j = 0; j < n; j++) v[n + j] = Var::Parameter(py[j]);
+	Var error = SplineFitError(v, v + n, n, target);
+	Gradient(error, v, 2 * n, gradient);
+	return error.f;
+}
+
+// samples of one round of the target, 8 per control point
+void SampleCurve(const Curve& curve, int m, std::vector<vec2>& samples) {
+	samples.resize(m);
+	for (int k = 0; k < m; k++) {
+		Clifford x, y;
+		curve.Eval(curve.Period() * k / m, x, y);
+		samples[k] = vec2(x.f, y.f);
+	}
+}
+
+// gradient descent with a backtracking line search from control points on the target
+CatmullRomPath * FitPath(const Curve& target, int n, int iterations = 200) {
+	std::vector<vec2> samples, cps;
+	SampleCurve(target, 8 * n, samples);
+	std::vector<float> px(n), py(n), nx(n), ny(n), gradient;
+	for (int j = 0; j < n; j++) {		// segment j starts at control point j + 1
+		px[(j + 1) % n] = samples[8 * j].x;
+		py[(j + 1) % n] = samples[8 * j].y;
+	}
+	float error0 = SplineFitError(px, py, samples), error = error0, step = 1;
+	int it;
+	for (it = 0; it < iterations; it++) {
+		SplineFitGradient(px, py, samples, gradient);
+		float g2 = 0;
+		for (size_t k = 0; k < gradient.size(); k++) g2 += gradient[k] * gradient[k];
+		if (g2 == 0) break;
+		float newError;
+		for (;;) {		// halve the step until the error decreases enough, then try a longer one next time
+			for (int j = 0; j < n; j++) {
+				nx[j] = px[j] - step * gradient[j];
+				ny[j] = py[j] - step * gradient[n + j];
+			}
+			newError = SplineFitError(nx, ny, samples);
+			if (newError <= error - 0.5f * step * g2 || step < 1e-10f) break;
+			step *= 0.5f;
+		}
+		if (newError >= error) break;	// converged within float precision
+		px.swap(nx); py.swap(ny);
+		error = newError;
+		step *= 2;
+	}
+	printf("Fitted path: %d control points, mean squared error %g -> %g in %d iterations\n", n, error0, error, it);
+	for (int j = 0; j < n; j++) cps.push_back(vec2(px[j], py[j]));
+	return new CatmullRomPath(cps);
+}
+
+// largest difference between the tape gradient and central finite differences relative to the largest gradient
+float SplineFitGradientCheck(const std::vector<float>& px, const std::vector<float>& py, const std::vector<vec2>& target) {
+	std::vector<float> gradient;
+	SplineFitGradient(px, py, target, gradient);
+	float maxGradient = 0, maxError = 0, h = 1e-2f;	// the error is quadratic, so only rounding limits h
+	for (size_t k = 0; k < gradient.size(); k++) {
+		std::vector<float> x = px, y = py;
+		float& p = (k < px.size()) ? x[k] : y[k - px.size()];
+		float p0 = p;
+		p = p0 + h;
+		float plus = SplineFitError(x, y, target);
+		p = p0 - h;
+		float minus = SplineFitError(x, y, target);
+		maxGradient = fmaxf(maxGradient, fabsf(gradient[k]));
+		maxError = fmaxf(maxError, fabsf(gradient[k] - (plus - minus) / (2 * h)));
+	}
+	return maxGradient > 0 ? maxError / maxGradient : maxError;
+}
+
+// the built-in path
+struct CirclePath : public Curve {
+	float r;
+	CirclePath(float r0) { r = r0; }
+
+	void Eval(const float * t, int n, float * xf, float * xd, float * yf, float * yd) const {
+		FastSinCos(t, xf, yf, n);		// x = r sin(t), y = r cos(t)
+		for (int k = 0; k < n; k++) {
+			xd[k] = yf[k] * r; yd[k] = -xf[k] * r;
+			xf[k] *= r; yf[k] *= r;
+		}
+	}
+	using Curve::Eval;
+};
+
+CirclePath circlePath(3.0f);
+
+// a path scaled about the origin, -paths n simulates n of them nested into each other
+struct ScaledPath : public Curve {
+	const Curve * base;
+	float scale;
+	ScaledPath(const Curve * base0, float scale0) { base = base0; scale = scale0; }
+
+	void Eval(const float * t, int n, float * xf, float * xd, float * yf, float * yd) const {
+		base->Eval(t, n, xf, xd, yf, yd);
+		Scale(n, xf, xd, yf, yd);
+	}
+	void Eval(const double * t, int n, float * xf, float * xd, float * yf, float * yd) const {
+		base->Eval(t, n, xf, xd, yf, yd);
+		Scale(n, xf, xd, yf, yd);
+	}
+	void Scale(int n, float * xf, float * xd, float * yf, float * yd) const {
+		for (int k = 0; k < n; k++) {
+			xf[k] *= scale; xd[k] *= scale;
+			yf[k] *= scale; yd[k] *= scale;
+		}
+	}
+	float Period() const { return base->Period(); }
+	using Curve::Eval;
+};
+
+// runtime paths given on the command line, the first one replaces the built-in path
+std::vector<Curve *> userPaths;
+
+const Curve * CurrentPath() { return userPaths.empty() ? &circlePath : userPaths[0]; }
+
+float PathPeriod() { return CurrentPath()->Period(); }
+
+void Path(float t, Clifford& x, Clifford& y) {
+	CurrentPath()->Eval(t, x, y);
+}
+
+void Path(double t, Clifford& x, Clifford& y) {
+	CurrentPath()->Eval(t, x, y);
+}
+
+//---------------------------------------------------------------------------------------------
+// Persistent worker threads: ParallelFor splits [0, n) into chunks taken by the workers and
+// the calling thread, and returns when all chunks are done
+//---------------------------------------------------------------------------------------------
+class ThreadPool {
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start, done;
+	void (*job)(const void *, int, int);		// calls the body of the current ParallelFor
+	const void * body;
+	int n, chunk, busy, generation;
+	std::atomic<int> next;
+	bool quit;
+
+	void Work() {
+		for (int begin = next.fetch_add(chunk); begin < n; begin = next.fetch_add(chunk)) job(body, begin, std::min(begin + chunk, n));
+	}
+
+	void Worker() {
+		int seen = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (!quit && generation == seen) start.wait(lock);
+				if (quit) return;
+				seen = generation;
+			}
+			Work();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--busy == 0) done.notify_one();
+		}
+	}
+
+public:
+	ThreadPool() : job(NULL), body(NULL), n(0), chunk(1), busy(0), generation(0), next(0), quit(false) { }
+
+	void Start(int nThreads) {
+		for (int i = 0; i < nThreads; i++) workers.push_back(std::thread(&ThreadPool::Worker, this));
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		start.notify_all();
+		for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+	}
+
+	int Threads() const { return workers.size() + 1; }
+
+	template<class F> static void Call(const void * body, int begin, int end) { (*(const F *)body)(begin, end); }
+
+	// body(begin, end) for the chunks; a template rather than std::function, so no lambda is copied to the heap
+	template<class F> void ParallelFor(int n0, int chunk0, const F& body0) {
+		if (workers.empty() || n0 <= chunk0) {	// not worth waking up the workers
+			for (int begin = 0; begin < n0; begin += chunk0) body0(begin, std::min(begin + chunk0, n0));
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &Call<F>; body = &body0; n = n0; chunk = chunk0;
+			next = 0;
+			busy = workers.size();
+			generation++;
+		}
+		start.notify_all();
+		Work();
+		std::unique_lock<std::mutex> lock(mutex);
+		while (busy > 0) done.wait(lock);
+	}
+};
+
+ThreadPool threadPool;
+
+//---------------------------------------------------------------------------------------------
+// Many vehicles following paths, stored as structure of arrays and stepped in parallel
+//---------------------------------------------------------------------------------------------
+class VehicleSystem {
+	static const int CHUNK = 4096;		// vehicles of a parallel task
+	std::vector<const Curve *> paths;
+	std::vector<int> pathId;
+	std::vector<double> param;			// path parameter, double for paths of many spline segments
+	std::vector<float> speed;			// change of the parameter in a second
+	std::vector<float> posX, posY, tanX, tanY;	// result of the last step, tangent is normalized
+	std::vector<float> prevX, prevY, prevTanX, prevTanY;	// result of the step before
+	std::vector<float> staging;			// the frame's vehicles if the buffer cannot be mapped
+	unsigned int vao, vbo[2];			// shape, and point and tangent of the vehicles interleaved
+	unsigned int shapeTexture;			// vbo[0] for the wide lines
+	int nShapePoints;
+	vec4 color;
+public:
+	VehicleSystem() { vao = 0; shapeTexture = 0; nShapePoints = 0; }
+
+	int AddPath(const Curve * curve) {
+		paths.push_back(curve);
+		return paths.size() - 1;
+	}
+
+	// vehicles of the same path should be added together, so that a chunk evaluates long runs in batch
+	void Add(int path, double param0, float speed0) {
+		pathId.push_back(path); param.push_back(param0); speed.push_back(speed0);
+		posX.push_back(0); posY.push_back(0); tanX.push_back(1); tanY.push_back(0);
+		prevX.push_back(0); prevY.push_back(0); prevTanX.push_back(1); prevTanY.push_back(0);
+	}
+
+	int Size() const { return pathId.size(); }
+
+	// removes the vehicles, the paths and the GPU buffers
+	void Clear() {
+		paths.clear(); pathId.clear(); param.clear(); speed.clear();
+		posX.clear(); posY.clear(); tanX.clear(); tanY.clear();
+		prevX.clear(); prevY.clear(); prevTanX.clear(); prevTanY.clear();
+		staging.clear();
+		if (vao) {
+			glDeleteVertexArrays(1, &vao);
+			glDeleteBuffers(2, &vbo[0]);
+			glDeleteTextures(1, &shapeTexture);
+		}
+		vao = 0;
+		shapeTexture = 0;
+	}
+
+	// the GPU buffers, and the positions at the initial parameters, so the first steps start from there
+	void Create(const vec2 * shape, int nShapePoints0, vec4 color0) {
+		threadPool.ParallelFor(Size(), CHUNK, [this](int begin, int end) {
+			Evaluate(begin, end);
+			for (int i = begin; i < end; i++) {
+				prevX[i] = posX[i]; prevY[i] = posY[i]; prevTanX[i] = tanX[i]; prevTanY[i] = tanY[i];
+			}
+		});
+		color = color0;
+		nShapePoints = nShapePoints0;
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glGenBuffers(2, &vbo[0]);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+		glBufferData(GL_ARRAY_BUFFER, nShapePoints * sizeof(vec2), shape, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
+		glBufferData(GL_ARRAY_BUFFER, Size() * 4 * sizeof(float), NULL, GL_STREAM_DRAW);	// written every frame by Draw
+		for (int a = 1; a <= 4; a++) {		// pointX, pointY, tangentX, tangentY: one float each per instance
+			glEnableVertexAttribArray(a);
+			glVertexAttribPointer(a, 1, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (const void *)((a - 1) * sizeof(float)));
+			glVertexAttribDivisor(a, 1);
+		}
+		shapeTexture = CreatePointTexture(vbo[0], nShapePoints);
+	}
+
+	// positions and normalized tangents of vehicles [begin, end) at their parameters
+	void Evaluate(int begin, int end) {
+		for (int i = begin; i < end; ) {	// runs of the same path in one batch evaluation
+			int run = i + 1;
+			while (run < end && pathId[run] == pathId[i]) run++;
+			double period = paths[pathId[i]]->Period();
+			for (int j = i; j < run; j++)	// kept within a round in both directions, so the parameter does not lose precision
+				if (param[j] >= period || param[j] < 0) param[j] -= period * floor(param[j] / period);
+			paths[pathId[i]]->Eval(&param[i], run - i, &posX[i], &tanX[i], &posY[i], &tanY[i]);
+			i = run;
+		}
+		for (int i = begin; i < end; i++) {
+			float l = sqrtf(tanX[i] * tanX[i] + tanY[i] * tanY[i]);
+			if (l > 0) { tanX[i] /= l; tanY[i] /= l; }
+		}
+	}
+
+	void Step(float dt) {
+		threadPool.ParallelFor(Size(), CHUNK, [this, dt](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				prevX[i] = posX[i]; prevY[i] = posY[i]; prevTanX[i] = tanX[i]; prevTanY[i] = tanY[i];
+				param[i] += speed[i] * dt;
+			}
+			Evaluate(begin, end);
+		});
+	}
+
+	// alpha: 0 draws the state of the step before the last one, 1 the state of the last step.
+	// The parallel tasks write the vehicles straight into the mapped buffer, the invalidation orphans
+	// the storage the GPU may still be drawing, so neither side waits and the buffer is not reallocated
+	void Draw(float alpha) {
+		if (Size() == 0) return;
+		size_t bytes = Size() * 4 * sizeof(float);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
+		float * data = (float *)glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		bool mapped = (data != NULL);
+		if (!mapped) {
+			staging.resize(Size() * 4);
+			data = &staging[0];
+		}
+		threadPool.ParallelFor(Size(), CHUNK, [this, alpha, data](int begin, int end) {
+			float * v = data + 4 * begin;
+			if (alpha >= 1) {
+				for (int i = begin; i < end; i++, v += 4) { v[0] = posX[i]; v[1] = posY[i]; v[2] = tanX[i]; v[3] = tanY[i]; }
+				return;
+			}
+			for (int i = begin; i < end; i++, v += 4) {
+				float tx = prevTanX[i] + (tanX[i] - prevTanX[i]) * alpha;
+				float ty = prevTanY[i] + (tanY[i] - prevTanY[i]) * alpha;
+				float l = sqrtf(tx * tx + ty * ty);
+				if (l > 0) { tx /= l; ty /= l; }
+				v[0] = prevX[i] + (posX[i] - prevX[i]) * alpha;
+				v[1] = prevY[i] + (posY[i] - prevY[i]) * alpha;
+				v[2] = tx; v[3] = ty;
+			}
+		});
+		if (mapped) glUnmapBuffer(GL_ARRAY_BUFFER);
+		else glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+		mat4 MVPTransform = camera.V() * camera.P();
+		int location = glGetUniformLocation(shaderProgram, "MVP");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVPTransform);
+		location = glGetUniformLocation(shaderProgram, "color");
+		if (location >= 0) glUniform4f(location, color.x, color.y, color.z, color.w);
+
+		glBindVertexArray(vao);
+		DrawLineLoop(shapeTexture, 0, nShapePoints, Size());	// one vehicle outline per instance
+	}
+};
+
+
+class Object {
+	unsigned int vao;	// vertex array object id
+	unsigned int texture;	// the points for the wide lines
+	int nPoints;
+	vec4 color;
+public:
+
+	Object(const std::vector<vec2>& points, vec4 color0) {
+		color = color0;
+		nPoints = points.size();
+
+		glGenVertexArrays(1, &vao);	// create 1 vertex array object
+		glBindVertexArray(vao);		// make it active
+		unsigned int vbo;		// vertex buffer objects
+		glGenBuffers(1, &vbo);	// Generate 1 vertex buffer objects
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		// Map Attribute Array 0 to the current bound vertex buffer (vbo[0])
+
+		glBufferData(GL_ARRAY_BUFFER,      // copy to the GPU
+			points.size() * sizeof(vec2), // number of the vbo in bytes
+			points.data(),		   // address of the data array on the CPU
+			GL_STATIC_DRAW);	   // copy to GPU
+
+		glEnableVertexAttribArray(0); 
+		// Data organization of Attribute Array 0 
+		glVertexAttribPointer(0,			// Attribute Array 0
+			                  2, GL_FLOAT,  // components/attribute, component type
+							  GL_FALSE,		// not in fixed point format, do not normalized
+							  0, NULL);     // stride and offset: it is tightly packed
+		texture = CreatePointTexture(vbo, nPoints);
+	}
+
+	void Draw( vec2 point, vec2 tangent ) {
+		mat4 MVPTransform = camera.V() * camera.P();
+
+		// set GPU uniform matrix variable MVP with the content of CPU variable MVPTransform
+		int location = glGetUniformLocation(shaderProgram, "MVP");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVPTransform); // set uniform variable MVP to the MVPTransform
+		else printf("uniform MVP cannot be set\n");
+
+		glVertexAttrib1f(1, point.x);	// placement as constant attributes, the vao has no arrays for them
+		glVertexAttrib1f(2, point.y);
+		glVertexAttrib1f(3, tangent.x);
+		glVertexAttrib1f(4, tangent.y);
+
+		location = glGetUniformLocation(shaderProgram, "color");
+		if (location >= 0) glUniform4f(location, color.x, color.y, color.z, color.w);
+
+		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		DrawLineLoop(texture, 0, nPoints, 1);	// draw a single triangle with vertices defined in vao
+	}
+
+	void Animate(double t) {
+		Clifford x, y;
+		Path(t, x, y);
+		float tangentLength = sqrt(x.d * x.d + y.d * y.d);		// tangentLength == v
+		vec2 tangent(x.d / tangentLength, y.d / tangentLength);		// tangent == it
+		Draw(vec2(x.f, y.f), tangent);
+	}
+
+};
+
+// read-only view of a whole file, pages are loaded on demand by the operating system
+class MappedFile {
+	const char * data;
+	size_t size;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+	HANDLE file, mapping;
+#endif
+public:
+	MappedFile() { data = NULL; size = 0; }
+	~MappedFile() { Close(); }
+
+	const char * Data() const { return data; }
+	size_t Size() const { return size; }
+
+	bool Open(const char * fileName) {
+		Close();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+		file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = (size_t)fileSize.QuadPart;
+		mapping = size > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		if (mapping) data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!data) {
+			if (mapping) CloseHandle(mapping);
+			CloseHandle(file);
+			return false;
+		}
+#else
+		int file = open(fileName, O_RDONLY);
+		if (file < 0) return false;
+		struct stat status;
+		if (fstat(file, &status) == 0 && status.st_size > 0) {
+			size = status.st_size;
+			void * p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+			if (p != MAP_FAILED) {
+				data = (const char *)p;
+				madvise(p, size, MADV_SEQUENTIAL);     // read ahead, the upload goes from front to back
+			}
+		}
+		close(file);                    // the mapping keeps the file open
+		if (!data) return false;
+#endif
+		return true;
+	}
+
+	void Close() {
+		if (!data) return;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+		UnmapViewOfFile(data);
+		CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		munmap((void *)data, size);
+#endif
+		data = NULL;
+		size = 0;
+	}
+};
+
+//---------------------------------------------------------------------------------------------
+// Binary scene file, mapped into memory and used in place. Sections are 8 byte aligned and
+// referenced by byte offsets from the start of the file, which become pointers on loading.
+// Path programs are stored as bytecode and splines as segment coefficients, so nothing is compiled.
+//---------------------------------------------------------------------------------------------
+const unsigned int SCENE_VERSION = 2;
+
+struct SceneHeader {
+	char magic[4];					// "SCNE"
+	unsigned int version;			// SCENE_VERSION
+	float camera[4];				// center and size of the visible world
+	unsigned int objectCount, pathCount, vehicleCount, vertexCount;
+	unsigned long long objectsOffset, pathsOffset, vehiclesOffset, verticesOffset;
+	unsigned int vehicleFirstVertex, vehicleVertexCount;	// outline of the vehicles in the vertex array
+	float vehicleColor[4];
+	unsigned int reserved;
+};
+
+struct SceneObject {				// a line loop of the vertex array placed at point, x axis rotated to tangent
+	unsigned int firstVertex, vertexCount;
+	float color[4];
+	float point[2], tangent[2];
+};
+
+enum ScenePathType { SCENE_PROGRAM, SCENE_SPLINE };
+
+struct ScenePath {
+	unsigned int type;				// ScenePathType
+	unsigned int size;				// instructions of the program or segments of the spline
+	unsigned long long offset;		// Instruction array, or the coefficient arrays ax bx cx dx ay by cy dy of the segments
+	int xRegister, yRegister;		// outputs of a program
+	unsigned int closed;			// the spline is a loop
+	unsigned int reserved;
+};
+
+struct SceneVehicle {
+	unsigned int path;
+	float param, speed;
+};
+
+class Scene {
+	MappedFile file;
+	const SceneHeader * header;		// everything points into the mapped file
+	const SceneObject * objects;
+	std::vector<Curve *> paths;		// built from the path definitions
+	unsigned int vao, vbo;			// all vertices of the scene in one buffer
+	unsigned int texture;			// vbo for the wide lines
+
+	// count elements of the given size fit into the file from offset, which is 8 byte aligned like the mapping
+	bool Fits(unsigned long long offset, unsigned long long count, size_t elementSize) {
+		return offset % 8 == 0 && offset <= file.Size() && (file.Size() - offset) / elementSize >= count;
+	}
+
+	// the path runs on the data in the mapping, only its bytecode is checked
+	Curve * BuildPath(const ScenePath& definition) {
+		const char * data = file.Data() + definition.offset;
+		if (definition.type == SCENE_PROGRAM) {
+			PathProgram * program = new PathProgram();
+			if (program->Attach((const Instruction *)data, definition.size, definition.xRegister, definition.yRegister)) return program;
+			delete program;
+		} else if (definition.type == SCENE_SPLINE) {
+			SplinePath * spline = new SplinePath();
+			if (spline->Attach((const float *)data, definition.size, definition.closed != 0)) return spline;
+			delete spline;
+		}
+		return NULL;
+	}
+
+	bool Invalid(const char * fileName, const char * message) {
+		printf("%s: %s\n", fileName, message);
+		Clear();
+		return false;
+	}
+public:
+	Scene() { header = NULL; objects = NULL; vao = vbo = texture = 0; }
+
+	bool Loaded() const { return header != NULL; }
+
+	void Clear() {
+		for (size_t i = 0; i < paths.size(); i++) delete paths[i];
+		paths.clear();
+		if (vao) {
+			glDeleteVertexArrays(1, &vao);
+			glDeleteBuffers(1, &vbo);
+			glDeleteTextures(1, &texture);
+		}
+		vao = vbo = texture = 0;
+		header = NULL;
+		objects = NULL;
+		file.Close();
+	}
+
+	// replaces the current scene and the simulated vehicles
+	bool Load(const char * fileName, VehicleSystem& vehicles) {
+		Clear();
+		if (!file.Open(fileName)) {
+			printf("Cannot map scene file %s\n", fileName);
+			return false;
+		}
+		header = (const SceneHeader *)file.Data();
+		if ((size_t)file.Data() % 8 != 0) return Invalid(fileName, "mapping not aligned");
+		if (file.Size() < sizeof(SceneHeader) || memcmp(header->magic, "SCNE", 4) != 0) return Invalid(fileName, "not a scene file");
+		if (header->version != SCENE_VERSION) return Invalid(fileName, "unsupported scene version");
+		if (!Fits(header->objectsOffset, header->objectCount, sizeof(SceneObject)) ||
+			!Fits(header->pathsOffset, header->pathCount, sizeof(ScenePath)) ||
+			!Fits(header->vehiclesOffset, header->vehicleCount, sizeof(SceneVehicle)) ||
+			!Fits(header->verticesOffset, header->vertexCount, sizeof(vec2)) ||
+			header->vehicleFirstVertex > header->vertexCount || header->vehicleVertexCount > header->vertexCount - header->vehicleFirstVertex)
+			return Invalid(fileName, "section out of the file or not aligned");
+		objects = (const SceneObject *)(file.Data() + header->objectsOffset);
+		for (unsigned int i = 0; i < header->objectCount; i++)
+			if (objects[i].firstVertex > header->vertexCount || objects[i].vertexCount > header->vertexCount - objects[i].firstVertex)
+				return Invalid(fileName, "object out of the vertex array");
+
+		const ScenePath * pathDefinitions = (const ScenePath *)(file.Data() + header->pathsOffset);
+		for (unsigned int i = 0; i < header->pathCount; i++) {
+			const ScenePath& definition = pathDefinitions[i];
+			size_t elementSize = definition.type == SCENE_PROGRAM ? sizeof(Instruction) : 8 * sizeof(float);
+			if (!Fits(definition.offset, definition.size, elementSize))
+				return Invalid(fileName, "path out of the file or not aligned");
+			Curve * curve = BuildPath(definition);
+			if (!curve) return Invalid(fileName, "invalid path");
+			paths.push_back(curve);
+		}
+		const SceneVehicle * vehicleDefinitions = (const SceneVehicle *)(file.Data() + header->vehiclesOffset);
+		for (unsigned int i = 0; i < header->vehicleCount; i++)
+			if (vehicleDefinitions[i].path >= header->pathCount) return Invalid(fileName, "vehicle on a missing path");
+
+		// the vertices go from the mapping to the GPU, the vehicles are copied as they are simulated
+		const vec2 * vertices = (const vec2 *)(file.Data() + header->verticesOffset);
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, header->vertexCount * sizeof(vec2), vertices, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+		texture = CreatePointTexture(vbo, header->vertexCount);
+
+		vehicles.Clear();
+		for (size_t i = 0; i < paths.size(); i++) vehicles.AddPath(paths[i]);
+		for (unsigned int i = 0; i < header->vehicleCount; i++)
+			vehicles.Add(vehicleDefinitions[i].path, vehicleDefinitions[i].param, vehicleDefinitions[i].speed);
+		const float * c = header->vehicleColor;
+		vehicles.Create(vertices + header->vehicleFirstVertex, header->vehicleVertexCount, vec4(c[0], c[1], c[2], c[3]));
+
+		camera.SetView(header->camera[0], header->camera[1], header->camera[2], header->camera[3]);
+		return true;
+	}
+
+	void Draw() {
+		if (!Loaded()) return;
+		mat4 MVPTransform = camera.V() * camera.P();
+		int location = glGetUniformLocation(shaderProgram, "MVP");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVPTransform);
+		int colorLocation = glGetUniformLocation(shaderProgram, "color");
+
+		glBindVertexArray(vao);
+		for (unsigned int i = 0; i < header->objectCount; i++) {
+			const SceneObject& o = objects[i];
+			glVertexAttrib1f(1, o.point[0]);	// placement as constant attributes, like Object::Draw
+			glVertexAttrib1f(2, o.point[1]);
+			glVertexAttrib1f(3, o.tangent[0]);
+			glVertexAttrib1f(4, o.tangent[1]);
+			if (colorLocation >= 0) glUniform4f(colorLocation, o.color[0], o.color[1], o.color[2], o.color[3]);
+			DrawLineLoop(texture, o.firstVertex, o.vertexCount, 1);
+		}
+	}
+
+	int Objects() const { return Loaded() ? header->objectCount : 0; }
+	int Paths() const { return paths.size(); }
+};
+
+// appends 8 byte aligned data to a scene file image and returns its offset
+unsigned long long AppendAligned(std::vector<char>& data, const void * p, size_t bytes) {
+	data.resize((data.size() + 7) & ~(size_t)7);
+	unsigned long long offset = data.size();
+	if (bytes > 0) data.insert(data.end(), (const char *)p, (const char *)p + bytes);
+	return offset;
+}
+
+// Demo scene: the circles of radius 1..9 as compiled path programs, their outlines as objects, and the
+// vehicles distributed on them. Other tools can write the same layout.
+bool SaveScene(const char * fileName, int nPaths, int nPathPoints, int nVehicles) {
+	std::vector<vec2> shape;		// the vehicle of onInitialization
+	shape.push_back(vec2(-1, -1));
+	shape.push_back(vec2(1, 0));
+	shape.push_back(vec2(-1, 1));
+	shape.push_back(vec2(0, 0));
+
+	std::vector<char> data(sizeof(SceneHeader));
+	SceneHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "SCNE", 4);
+	header.version = SCENE_VERSION;
+	header.camera[2] = header.camera[3] = 10;
+	header.vehicleColor[1] = header.vehicleColor[2] = header.vehicleColor[3] = 1;
+
+	std::vector<vec2> vertices(shape);
+	std::vector<SceneObject> objects;
+	std::vector<ScenePath> paths;
+	std::vector<std::string> sources;
+	for (int k = 0; k < nPaths; k++) {
+		char source[128];
+		float r = 1 + 8.0f * k / std::max(1, nPaths - 1);
+		sprintf(source, "x = %g * sin(t); y = %g * cos(t)", r, r);
+		sources.push_back(source);
+		SceneObject o = { (unsigned int)vertices.size(), (unsigned int)nPathPoints, { 1, 1, 1, 1 }, { 0, 0 }, { 1, 0 } };
+		for (int i = 0; i < nPathPoints; i++) vertices.push_back(vec2(r * sinf(2 * M_PI * i / nPathPoints), r * cosf(2 * M_PI * i / nPathPoints)));
+		objects.push_back(o);
+	}
+	std::vector<SceneVehicle> vehicles;
+	for (int i = 0; i < nVehicles; i++) {
+		SceneVehicle v = { (unsigned int)((long)i * nPaths / nVehicles), 2 * (float)M_PI * i / nVehicles, 0.5f + (float)rand() / RAND_MAX };
+		vehicles.push_back(v);
+	}
+
+	for (int k = 0; k < nPaths; k++) {
+		PathProgram program;
+		if (!program.Compile(sources[k].c_str())) return false;
+		ScenePath p = { SCENE_PROGRAM, (unsigned int)program.Size(), AppendAligned(data, program.Code(), program.Size() * sizeof(Instruction)),
+		                program.XRegister(), program.YRegister(), 0, 0 };
+		paths.push_back(p);
+	}
+	header.objectCount = objects.size();
+	header.objectsOffset = AppendAligned(data, objects.data(), objects.size() * sizeof(SceneObject));
+	header.pathCount = paths.size();
+	header.pathsOffset = AppendAligned(data, paths.data(), paths.size() * sizeof(ScenePath));
+	header.vehicleCount = vehicles.size();
+	header.vehiclesOffset = AppendAligned(data, vehicles.data(), vehicles.size() * sizeof(SceneVehicle));
+	header.vertexCount = vertices.size();
+	header.verticesOffset = AppendAligned(data, vertices.data(), vertices.size() * sizeof(vec2));
+	header.vehicleFirstVertex = 0;
+	header.vehicleVertexCount = shape.size();
+	memcpy(&data[0], &header, sizeof(header));
+
+	FILE * out = fopen(fileName, "wb");
+	if (!out) {
+		printf("Cannot write %s\n", fileName);
+		return false;
+	}
+	fwrite(data.data(), 1, data.size(), out);
+	fclose(out);
+	return true;
+}
+
+//---------------------------------------------------------------------------------------------
+// Time base: nanoseconds of a monotonic clock in 64 bit integers, fixed simulation steps and frame intervals
+//---------------------------------------------------------------------------------------------
+// Times are kept as integers and converted to seconds only as short differences or after reducing them
+// by a period, so a run of weeks animates as smoothly as the first minute.
+typedef long long Nanoseconds;
+const Nanoseconds NANOSECONDS_PER_SECOND = 1000000000LL;
+
+const std::chrono::steady_clock::time_point programStart = std::chrono::steady_clock::now();
+
+// nsec since the start of the program, never goes backwards
+Nanoseconds MonotonicTime() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - programStart).count();
+}
+
+// Fixed-step simulation at a variable frame rate: Advance gives the number of steps that bring the simulated
+// time up to now, and Alpha where now is after the last step. A frame shows the state interpolated between
+// the last two steps, i.e. it is one step behind, but the motion does not depend on the frame intervals.
+class FixedStep {
+	Nanoseconds dt, maxLag;			// length of a step, lag skipped instead of caught up with
+	Nanoseconds simulated;			// time of the last step
+	bool synced;
+	long skipped;					// times the simulation has fallen behind by more than maxLag
+public:
+	FixedStep(Nanoseconds dt0, Nanoseconds maxLag0) { dt = dt0; maxLag = maxLag0; simulated = 0; synced = false; skipped = 0; }
+
+	double Dt() const { return (double)dt / NANOSECONDS_PER_SECOND; }			// sec
+	double Seconds() const { return (double)simulated / NANOSECONDS_PER_SECOND; }	// time of the last step
+	long Skipped() const { return skipped; }
+	void Unsync() { synced = false; }
+
+	// steps to do, or -1 if the state has to be set directly for Seconds(): at the start and after a stall
+	int Advance(Nanoseconds now) {
+		if (!synced || now - simulated > maxLag) {
+			if (synced) skipped++;
+			simulated = now - now % dt;
+			synced = true;
+			return -1;
+		}
+		int n = now > simulated ? (int)((now - simulated) / dt) : 0;
+		simulated += n * dt;
+		return n;
+	}
+
+	// 0: the frame shows the state of the step before the last one, 1: the state of the last step
+	float Alpha(Nanoseconds now) const {
+		float alpha = (float)(now - simulated) / dt;
+		return alpha < 0 ? 0 : (alpha > 1 ? 1 : alpha);
+	}
+};
+
+// statistics of the intervals between frames without storing them: Welford's running mean and variance
+class FrameIntervals {
+	Nanoseconds last, shortest, longest;
+	long count;
+	double mean, m2;				// msec, m2: sum of the squared deviations from the mean
+public:
+	FrameIntervals() { last = -1; shortest = longest = 0; count = 0; mean = m2 = 0; }
+
+	void Add(Nanoseconds now) {
+		if (last >= 0) {
+			Nanoseconds delta = now - last;
+			if (count == 0 || delta < shortest) shortest = delta;
+			if (count == 0 || delta > longest) longest = delta;
+			double ms = delta / 1e6;
+			count++;
+			double d = ms - mean;
+			mean += d / count;
+			m2 += d * (ms - mean);
+		}
+		last = now;
+	}
+
+	long Count() const { return count; }
+	double MeanMs() const { return mean; }
+	double DeviationMs() const { return count > 1 ? sqrt(m2 / (count - 1)) : 0; }
+	double ShortestMs() const { return shortest / 1e6; }
+	double LongestMs() const { return longest / 1e6; }
+
+	void Print() const {
+		if (count > 0) printf("Frame intervals: %.3f ms mean, %.3f ms deviation, %.3f - %.3f ms in %ld frames\n",
+			MeanMs(), DeviationMs(), ShortestMs(), LongestMs(), count);
+	}
+};
+
+FrameIntervals frameIntervals;
+
+// the frame benchmark drives the animation with deterministic timestamps instead of the wall clock
+Nanoseconds benchmarkTime = -1;
+int benchmarkFrames = 0;				// frames of the benchmark, 0: interactive run
+const char * benchmarkFile = NULL;		// JSON output of the benchmark, stdout if NULL
+
+//---------------------------------------------------------------------------------------------
+// Input log: -record file saves every event and time sample, -replay file runs them again as fast as possible
+//---------------------------------------------------------------------------------------------
+// The file starts with "ILOG" and the version, then a record is a type byte and a payload whose size depends on
+// the type. Time samples are logged where ElapsedTime reads the clock, so the replayed callbacks see exactly the
+// times of the recording. Only logs of this version are replayed: older ones sampled the time at other places,
+// so the samples would not be read where they were taken.
+const unsigned int INPUT_LOG_VERSION = 3;		// 3: onDisplay samples the time too
+
+class InputLog {
+	FILE * file;
+	bool replaying;
+public:
+	enum Type { KEY_DOWN, KEY_UP, MOUSE, MOTION, IDLE = 5, DISPLAY, TIME_NS };	// 4 was the msec time sample of version 1
+	struct Record {
+		unsigned char type, code, state;	// code: key or mouse button
+		short x, y;
+		Nanoseconds time;
+		Record(unsigned char type0 = IDLE, unsigned char code0 = 0, unsigned char state0 = 0, int x0 = 0, int y0 = 0, Nanoseconds time0 = 0) {
+			type = type0; code = code0; state = state0; x = x0; y = y0; time = time0;
+		}
+	};
+
+	InputLog() { file = NULL; replaying = false; }
+
+	bool Open(const char * fileName, bool replay) {
+		file = fopen(fileName, replay ? "rb" : "wb");
+		if (!file) {
+			printf("Cannot open input log %s\n", fileName);
+			return false;
+		}
+		replaying = replay;
+		if (!replay) {
+			fwrite("ILOG", 1, 4, file);
+			fwrite(&INPUT_LOG_VERSION, 4, 1, file);
+			return true;
+		}
+		// checked here, before the window is created, so a wrong file fails without opening a window
+		unsigned char magic[4] = { 0, 0, 0, 0 };
+		unsigned int version = 0;
+		bool header = fread(magic, 1, 4, file) == 4 && memcmp(magic, "ILOG", 4) == 0 && fread(&version, 4, 1, file) == 1;
+		if (!header || version != INPUT_LOG_VERSION) {
+			printf(!header ? "%s is not an input log\n" : "%s is an input log of an unsupported version\n", fileName);
+			Close();
+			return false;
+		}
+		return true;
+	}
+	void Close() {
+		if (file) fclose(file);
+		file = NULL;
+	}
+	bool Recording() { return file && !replaying; }
+	bool Replaying() { return file && replaying; }
+
+	void Write(const Record& r) {
+		if (!Recording()) return;
+		unsigned char buffer[12];
+		int n = 0;
+		buffer[n++] = r.type;
+		if (r.type == KEY_DOWN || r.type == KEY_UP || r.type == MOUSE) buffer[n++] = r.code;
+		if (r.type == MOUSE) buffer[n++] = r.state;
+		if (r.type <= MOTION) {
+			memcpy(buffer + n, &r.x, 2);
+			memcpy(buffer + n + 2, &r.y, 2);
+			n += 4;
+		}
+		if (r.type == TIME_NS) {
+			memcpy(buffer + n, &r.time, 8);
+			n += 8;
+		}
+		fwrite(buffer, 1, n, file);
+	}
+
+	bool Read(Record& r) {
+		if (!Replaying() || fread(&r.type, 1, 1, file) != 1) return false;
+		bool ok = true;
+		if (r.type == KEY_DOWN || r.type == KEY_UP || r.type == MOUSE) ok = ok && fread(&r.code, 1, 1, file) == 1;
+		if (r.type == MOUSE) ok = ok && fread(&r.state, 1, 1, file) == 1;
+		if (r.type <= MOTION) ok = ok && fread(&r.x, 2, 1, file) == 1 && fread(&r.y, 2, 1, file) == 1;
+		if (r.type == TIME_NS) ok = ok && fread(&r.time, 8, 1, file) == 1;
+		if (!ok || r.type > TIME_NS || r.type == MOTION + 1) {
+			printf("Corrupt input log\n");
+			exit(1);
+		}
+		return true;
+	}
+
+	// the clock sample now is logged when recording, and replaced by the logged one when replaying
+	Nanoseconds Time(Nanoseconds now) {
+		if (Recording()) Write(Record(TIME_NS, 0, 0, 0, 0, now));
+		if (!Replaying()) return now;
+		Record r;
+		if (!Read(r) || r.type != TIME_NS) {
+			printf("Replay diverged: the recording has no time sample here\n");
+			exit(1);
+		}
+		return r.time;
+	}
+};
+
+InputLog inputLog;
+
+// nsec since the start of the program
+Nanoseconds ElapsedTime() {
+	return benchmarkTime >= 0 ? benchmarkTime : inputLog.Time(MonotonicTime());
+}
+
+//---------------------------------------------------------------------------------------------
+// Frame capture: -capture name.ppm writes name00000.ppm, name00001.ppm..., -capture name.rgba a raw RGBA stream
+//---------------------------------------------------------------------------------------------
+// The frame is read into a ring of pixel pack buffers and mapped only RING - 1 frames later, when the copy
+// has surely finished, so glReadPixels does not stall the pipeline. A background thread writes the files;
+// if it falls behind, frames are dropped instead of slowing down the rendering.
+class FrameCapture {
+	static const int RING = 3;		// pixel pack buffers in flight
+	static const int POOL = 8;		// frames waiting for the writer thread at most
+	std::string name;				// file name without the extension
+	bool raw;						// single raw stream instead of an image sequence
+	FILE * rawFile;
+	int width, height;
+	unsigned int pbo[RING];
+	long frames, written, dropped;	// frames read back, written out and dropped for lack of room
+	std::vector<std::vector<unsigned char> > pool;
+	std::vector<int> freeSlots;		// pool entries that can be filled
+	std::deque<std::pair<int, long> > queue;	// pool entries and frame numbers to be written
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::thread writer;
+	bool stop;
+
+	void Write(const unsigned char * rgba, long frame) {	// rows are bottom up in OpenGL
+		if (raw) {
+			for (int y = height - 1; y >= 0; y--) fwrite(rgba + y * width * 4, 4, width, rawFile);
+			return;
+		}
+		char fileName[1024];
+		snprintf(fileName, sizeof(fileName), "%s%05ld.ppm", name.c_str(), frame);
+		FILE * file = fopen(fileName, "wb");
+		if (!file) {
+			printf("Cannot write %s\n", fileName);
+			return;
+		}
+		fprintf(file, "P6\n%d %d\n255\n", width, height);
+		std::vector<unsigned char> row(width * 3);
+		for (int y = height - 1; y >= 0; y--) {
+			for (int x = 0; x < width; x++)
+				for (int c = 0; c < 3; c++) row[x * 3 + c] = rgba[(y * width + x) * 4 + c];
+			fwrite(&row[0], 1, row.size(), file);
+		}
+		fclose(file);
+	}
+
+	void WriterLoop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wakeUp.wait(lock, [this]() { return stop || !queue.empty(); });
+			if (queue.empty()) return;		// stopped and everything is written
+			std::pair<int, long> job = queue.front();
+			queue.pop_front();
+			lock.unlock();
+			Write(&pool[job.first][0], job.second);
+			lock.lock();
+			freeSlots.push_back(job.first);
+			written++;
+		}
+	}
+
+	void Collect(long frame) {		// hands the pixels of an earlier frame over to the writer
+		int slot;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (freeSlots.empty()) {
+				dropped++;
+				return;
+			}
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[frame % RING]);
+		void * pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, width * height * 4, GL_MAP_READ_BIT);
+		if (pixels) memcpy(&pool[slot][0], pixels, width * height * 4);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pixels) queue.push_back(std::make_pair(slot, frame));
+		else freeSlots.push_back(slot);
+		wakeUp.notify_one();
+	}
+public:
+	FrameCapture() { rawFile = NULL; width = height = 0; frames = written = dropped = 0; stop = false; }
+
+	bool Active() { return width > 0; }
+
+	bool Start(const char * fileName, int width0, int height0) {
+		name = fileName;
+		size_t dot = name.rfind('.');
+		std::string extension = dot == std::string::npos ? "" : name.substr(dot);
+		raw = (extension == ".rgba");
+		if (!raw && extension != ".ppm") {
+			printf("Capture file %s should be .ppm or .rgba\n", fileName);
+			return false;
+		}
+		if (raw) {
+			rawFile = fopen(fileName, "wb");
+			if (!rawFile) {
+				printf("Cannot write %s\n", fileName);
+				return false;
+			}
+		}
+		name = name.substr(0, dot);
+		width = width0; height = height0;
+		glGenBuffers(RING, pbo);
+		for (int i = 0; i < RING; i++) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		pool.resize(POOL, std::vector<unsigned char>(width * height * 4));
+		for (int i = 0; i < POOL; i++) freeSlots.push_back(i);
+		writer = std::thread(&FrameCapture::WriterLoop, this);
+		return true;
+	}
+
+	// called after the frame is rendered, before the buffers are swapped
+	void Capture() {
+		if (!Active()) return;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[frames % RING]);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);	// asynchronous into the buffer
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		frames++;
+		if (frames >= RING) Collect(frames - RING);		// its buffer is read again in the next frame
+	}
+
+	// writes the pending frames and stops the writer; without a GL context the frames in flight are lost
+	void Finish(bool contextAlive) {
+		if (!Active()) return;
+		if (contextAlive)
+			for (long frame = std::max(0L, frames - RING + 1); frame < frames; frame++) Collect(frame);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			wakeUp.notify_one();
+		}
+		writer.join();
+		if (rawFile) {
+			fclose(rawFile);
+			printf("Captured %ld frames, play with: ffplay -f rawvideo -pixel_format rgba -video_size %dx%d %s.rgba\n",
+				written, width, height, name.c_str());
+		} else {
+			printf("Captured %ld frames into %s%%05d.ppm\n", written, name.c_str());
+		}
+		if (dropped > 0) printf("%ld frames dropped, the writer could not keep up\n", dropped);
+		if (contextAlive) glDeleteBuffers(RING, pbo);
+		width = height = 0;
+	}
+};
+
+FrameCapture capture;
+
+const char * captureFile = NULL;	// set on the command line
+
+//---------------------------------------------------------------------------------------------
+// Dynamic resolution: the frame is drawn into an offscreen framebuffer at a fraction of the window
+// size and upsampled to the window. The fraction follows the GPU time of the frames, measured by
+// timestamp queries read a few frames later, so that it stays within the budget: -frametime ms.
+// -resolution scale draws at a fixed fraction instead.
+//---------------------------------------------------------------------------------------------
+const float MIN_RESOLUTION_SCALE = 0.25f;
+
+class DynamicResolution {
+	static const int QUERIES = 4;	// frames in flight, the queries of a frame are read when its slot is reused
+	unsigned int fbo, colorBuffer, depthBuffer;
+	unsigned int queries[QUERIES][2];	// timestamps at the start and at the end of the frames
+	long frame;
+	int width, height;				// of the window and the framebuffer
+	float scale;					// of both sides
+	double budget;					// ms of GPU time per frame, 0: fixed scale
+	double smoothed;				// exponential average of the measured ms at the current scale, 0: none yet
+	int settle;						// frames until the measurements are at the current scale
+	long changes;
+
+	void Measure() {
+		if (frame < QUERIES) return;
+		unsigned int * q = queries[frame % QUERIES];
+		int available = 0;
+		glGetQueryObjectiv(q[1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) return;		// not waited for, the frame is simply not measured
+		GLuint64 start = 0, end = 0;
+		glGetQueryObjectui64v(q[0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(q[1], GL_QUERY_RESULT, &end);
+		if (settle > 0) {
+			settle--;
+			return;
+		}
+		double ms = (end - start) / 1e6;
+		smoothed = smoothed == 0 ? ms : 0.8 * smoothed + 0.2 * ms;
+		float newScale = scale;
+		if (smoothed > budget) newScale = scale * (float)std::max(0.8, sqrt(budget / smoothed));	// time ~ pixels
+		else if (smoothed < 0.7 * budget) newScale = scale * 1.05f;
+		newScale = std::min(1.0f, std::max(MIN_RESOLUTION_SCALE, newScale));
+		if (fabsf(newScale - scale) < 0.01f) return;
+		scale = newScale;
+		smoothed = 0;
+		settle = QUERIES;			// the frames in flight are still at the old scale
+		changes++;
+	}
+public:
+	DynamicResolution() { fbo = 0; frame = 0; scale = 1; budget = smoothed = 0; settle = 0; changes = 0; }
+
+	bool Active() const { return fbo != 0; }
+	float Scale() const { return scale; }
+	long Changes() const { return changes; }
+	int ScaledWidth() const { return std::max(1, (int)(width * scale + 0.5f)); }
+	int ScaledHeight() const { return std::max(1, (int)(height * scale + 0.5f)); }
+
+	// budgetMs > 0 adapts the scale, otherwise the frames are drawn at fixedScale
+	bool Start(int width0, int height0, double budgetMs, float fixedScale) {
+		width = width0;
+		height = height0;
+		budget = budgetMs;
+		scale = budget > 0 ? 1 : std::min(1.0f, std::max(MIN_RESOLUTION_SCALE, fixedScale));
+		glGenFramebuffers(1, &fbo);		// full size, a smaller scale uses a part of it
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glGenRenderbuffers(1, &colorBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+		glGenRenderbuffers(1, &depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+		bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (!complete) {
+			printf("Offscreen framebuffer of %dx%d is not supported\n", width, height);
+			return false;
+		}
+		glGenQueries(2 * QUERIES, &queries[0][0]);
+		return true;
+	}
+
+	// before anything of the frame is drawn
+	void Begin() {
+		if (!Active()) return;
+		if (budget > 0) Measure();
+		glQueryCounter(queries[frame % QUERIES][0], GL_TIMESTAMP);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, ScaledWidth(), ScaledHeight());
+	}
+
+	// after the frame is drawn, upsamples it into the window
+	void End() {
+		if (!Active()) return;
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, ScaledWidth(), ScaledHeight(), 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, width, height);
+		glQueryCounter(queries[frame % QUERIES][1], GL_TIMESTAMP);
+		frame++;
+	}
+};
+
+DynamicResolution resolution;
+double frameTimeBudget = 0;			// ms, set on the command line
+float fixedResolution = 0;			// set on the command line
+
+//---------------------------------------------------------------------------------------------
+// Render layers: the static layer (the path, or the objects of a scene) is drawn into a texture
+// only when its content, the camera or the viewport changes, and every frame starts with a copy
+// of it instead of a clear. The dynamic layer (the vehicles) is drawn on top every frame.
+//---------------------------------------------------------------------------------------------
+class LayerCache {
+	unsigned int fbo, texture;
+	int width, height;				// of the texture, the size of the viewport it was drawn with
+	mat4 view;						// camera of the content
+	bool enabled, valid;
+	long renders;
+	int target, viewport[4];		// framebuffer and viewport of the frame
+public:
+	LayerCache() { fbo = texture = 0; width = height = 0; enabled = true; valid = false; renders = 0; }
+
+	void Disable() { enabled = false; }
+	void Invalidate() { valid = false; }	// the content has changed
+	long Renders() const { return renders; }
+
+	// true if the layer has to be drawn: into the texture until End, or into the frame if caching is off
+	bool Begin(const mat4& camera) {
+		if (!enabled) return true;
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		bool sizeChanged = viewport[2] != width || viewport[3] != height;
+		if (valid && !sizeChanged && memcmp(&camera, &view, sizeof(mat4)) == 0) return false;
+		if (!fbo) {
+			glGenFramebuffers(1, &fbo);
+			glGenTextures(1, &texture);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		if (sizeChanged) {
+			width = viewport[2];
+			height = viewport[3];
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+		}
+		glViewport(0, 0, width, height);
+		glClear(GL_COLOR_BUFFER_BIT);	// with the clear color of the frame
+		view = camera;
+		valid = true;
+		renders++;
+		return true;
+	}
+
+	void End() {
+		if (!enabled) return;
+		glBindFramebuffer(GL_FRAMEBUFFER, target);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	}
+
+	// copies the layer into the viewport of the frame
+	void Draw() {
+		if (!enabled) return;
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glBlitFramebuffer(0, 0, width, height, viewport[0], viewport[1], viewport[0] + width, viewport[1] + height,
+			GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, target);
+	}
+};
+
+LayerCache staticLayer;
+
+// The virtual world: collection of two objects and the vehicles of the simulation, or a scene from a file
+Object * vehicle;
+Object * path;
+VehicleSystem vehicles;
+FixedStep vehicleSteps(NANOSECONDS_PER_SECOND / 60, NANOSECONDS_PER_SECOND / 4);	// simulation steps of the vehicles
+Scene scene;
+std::vector<const char *> sceneFiles;	// scenes switched with the keys 1..9
+int nVehicles = 0;		// simulated vehicles, set on the command line
+int nPaths = 1;			// simulated paths, the user paths if there are more of them, otherwise the scaled current path
+int nPathPoints = 0;	// points of the drawn path, 0: one per 0.1 parameter step
+const int MAX_DEFAULT_PATH_POINTS = 65536;
+
+void LoadScene(const char * fileName) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	staticLayer.Invalidate();			// the old scene is gone even if the new one cannot be loaded
+	if (!scene.Load(fileName, vehicles)) return;
+	printf("Scene %s: %d objects, %d paths, %d vehicles in %.2f msec\n", fileName, scene.Objects(), scene.Paths(), vehicles.Size(),
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+// after the initialization: loads the scene, starts the capture and runs the replay or the benchmark, defined with them below
+void StartRun();
+
+// Initialization, create an OpenGL context
+void onInitialization() {
+	glViewport(0, 0, windowWidth, windowHeight);
+
+	// compiled by the driver while the objects are set up
+	EnableParallelShaderCompile();
+	gpuProgram.Create(vertexSource, fragmentSource, "fragmentColor");
+	lineProgram.Create(lineVertexSource, lineFragmentSource, "fragmentColor");
+	glEnable(GL_BLEND);						// the coverage of the wide lines is in the alpha
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	std::vector<vec2> points;
+	points.push_back(vec2(-1, -1));
+	points.push_back(vec2(1, 0));
+	points.push_back(vec2(-1, 1));
+	points.push_back(vec2(0, 0));
+
+	vec4 color = vec4(1, 1, 0, 1);
+	vehicle = new Object(points, color);
+
+	std::vector<vec2> pathPoints;
+	if (nPathPoints <= 0) {		// a point per 0.1 parameter, but beyond MAX_DEFAULT_PATH_POINTS one per segment of a spline
+		double points = ceil(PathPeriod() / 0.1f);
+		if (points > MAX_DEFAULT_PATH_POINTS) points = std::max((double)MAX_DEFAULT_PATH_POINTS, ceil((double)PathPeriod()));
+		nPathPoints = (int)points;
+	}
+	for (int i = 0; i < nPathPoints; i++) {
+		double t = (double)PathPeriod() * i / nPathPoints;
+		Clifford x, y;
+		Path(t, x, y);								//minden pontban irnymenti derivlt szmts
+		pathPoints.push_back(vec2(x.f, y.f));
+	}
+	color = vec4(1, 1, 1, 1);
+	path = new Object(pathPoints, color);
+
+	std::vector<const Curve *> paths;
+	for (int i = 0; i < nPaths; i++) {		// path i of a single one is scaled by (i + 1) / nPaths, the last is the drawn one
+		if (userPaths.size() > 1) paths.push_back(userPaths[i]);
+		else if (i == nPaths - 1) paths.push_back(CurrentPath());
+		else paths.push_back(new ScaledPath(CurrentPath(), (i + 1.0f) / nPaths));
+	}
+	int firstPath = vehicles.AddPath(paths[0]);
+	for (int i = 1; i < nPaths; i++) vehicles.AddPath(paths[i]);
+	for (int i = 0; i < nVehicles; i++) {
+		float speed = 0.5f + (float)rand() / RAND_MAX;
+		int k = (int)((long)i * nPaths / nVehicles);	// consecutive vehicles share a path
+		vehicles.Add(firstPath + k, (double)paths[k]->Period() * i / nVehicles, speed);
+	}
+	vehicles.Create(&points[0], points.size(), vec4(0, 1, 1, 1));
+	threadPool.Start(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+	StartRun();
+}
+
+void onExit() {
+	capture.Finish(false);
+	inputLog.Close();
+	printf("Heap allocations in %ld of %ld frames, at most %ld in a frame\n",
+		frameAllocations.allocatingFrames, frameAllocations.frames, frameAllocations.maxPerFrame);
+	frameIntervals.Print();
+	if (vehicleSteps.Skipped() > 0) printf("The simulation fell behind %ld times, the lag was skipped\n", vehicleSteps.Skipped());
+	glDeleteProgram(gpuProgram.Id());
+	glDeleteProgram(lineProgram.Id());
+	printf("exit");
+}
+
+// Window has become invalid: Redraw
+void onDisplay() {
+	inputLog.Write(InputLog::Record(InputLog::DISPLAY));
+	resolution.Begin();										// into the offscreen framebuffer if it is on
+	ShaderProgram& program = lineWidth > 0 ? lineProgram : gpuProgram;
+	program.Use();
+	shaderProgram = program.Id();
+	glClearColor(0, 0, 0, 0);								// background color 
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);		// clear the screen
+	if (staticLayer.Begin(camera.V() * camera.P())) {		// only if it has changed
+		if (scene.Loaded()) scene.Draw();
+		else path -> Draw(vec2(0, 0), vec2(1, 0));
+		staticLayer.End();
+	}
+	staticLayer.Draw();
+	
+	Nanoseconds time = ElapsedTime();						// elapsed time since the start of the program
+	double sec = (double)time / NANOSECONDS_PER_SECOND;		// convert nsec to sec
+	if (!scene.Loaded()) vehicle->Animate(fmod(sec, PathPeriod()));	// reduced in double, a round is the same
+	vehicles.Draw(vehicleSteps.Alpha(time));				// between the last two simulation steps
+	frameIntervals.Add(time);
+	resolution.End();										// upsampled into the window
+
+	capture.Capture();										// read back for the frame capture, if it is on
+	glutSwapBuffers();										// exchange the two buffers
+	tape.Reset();											// the gradient evaluations of the frame are done
+	frameAllocations.EndFrame();
+}
+
+// Key of ASCII code pressed
+void onKeyboard(unsigned char key, int pX, int pY) {
+	inputLog.Write(InputLog::Record(InputLog::KEY_DOWN, key, 0, pX, pY));	// if recording
+	if (key == 'd') glutPostRedisplay();         // if d, invalidate display, i.e. redraw
+	if (key >= '1' && key <= '9' && key - '1' < (int)sceneFiles.size()) LoadScene(sceneFiles[key - '1']);
+}
+
+// Key of ASCII code released
+void onKeyboardUp(unsigned char key, int pX, int pY) {
+	inputLog.Write(InputLog::Record(InputLog::KEY_UP, key, 0, pX, pY));
+}
+
+// Mouse click event
+void onMouse(int button, int state, int pX, int pY) {
+	inputLog.Write(InputLog::Record(InputLog::MOUSE, button, state, pX, pY));
+	if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {  // GLUT_LEFT_BUTTON / GLUT_RIGHT_BUTTON and GLUT_DOWN / GLUT_UP
+	}
+}
+
+// Move mouse with key pressed
+void onMouseMotion(int pX, int pY) {
+	inputLog.Write(InputLog::Record(InputLog::MOTION, 0, 0, pX, pY));
+}
 
 // Idle event indicating that some time elapsed: do animation here
 void onIdle() {
-	long time = glutGet(GLUT_ELAPSED_TIME); // elapsed time since the start of the program
-	float sec = time / 1000.0f;				// convert msec to sec
-	camera.Animate(sec);					// animate the camera
+	inputLog.Write(InputLog::Record(InputLog::IDLE));
+	Nanoseconds time = ElapsedTime();		// elapsed time since the start of the program
+	camera.Animate((float)((double)time / NANOSECONDS_PER_SECOND));	// animate the camera
+	int steps = vehicleSteps.Advance(time);	// fixed steps until the simulation reaches the current time
+	if (steps < 0) steps = 1;				// start or stall: the vehicles have no exact state for a time, they go on from where they are
+	for (int i = 0; i < steps; i++) vehicles.Step((float)vehicleSteps.Dt());	// move the simulated vehicles
 	glutPostRedisplay();					// redraw the scene
 }
 
+// calls the handlers in the recorded order without waiting, the time samples are consumed by ElapsedTime;
+// the handlers log the events themselves, which does nothing while replaying. The replay is not headless:
+// onDisplay draws and reads back the frames, and GLUT gives a GL context only with a window, so it runs
+// after glutCreateWindow but instead of the event loop
+int RunReplay() {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	long events = 0, frames = 0;
+	InputLog::Record r;
+	while (inputLog.Read(r)) {
+		switch (r.type) {
+		case InputLog::KEY_DOWN: onKeyboard(r.code, r.x, r.y); break;
+		case InputLog::KEY_UP: onKeyboardUp(r.code, r.x, r.y); break;
+		case InputLog::MOUSE: onMouse(r.code, r.state, r.x, r.y); break;
+		case InputLog::MOTION: onMouseMotion(r.x, r.y); break;
+		case InputLog::IDLE: onIdle(); break;
+		case InputLog::DISPLAY: onDisplay(); frames++; break;
+		default:
+			printf("Replay diverged: a time sample was not read\n");
+			exit(1);
+		}
+		events++;
+	}
+	glFinish();
+	capture.Finish(true);
+	inputLog.Close();
+	printf("Replayed %ld events, %ld frames in %.3f sec\n", events, frames,
+		std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	return 0;
+}
+
+//---------------------------------------------------------------------------------------------
+// Frame benchmark: the onIdle, onDisplay loop at 60 Hz timestamps, -benchmark frames [-json file]
+//---------------------------------------------------------------------------------------------
+struct FrameStatistics {
+	std::vector<double> ms;
+
+	double Percentile(double p) {	// nearest rank
+		std::vector<double> sorted = ms;
+		std::sort(sorted.begin(), sorted.end());
+		int rank = (int)ceil(p / 100 * sorted.size()) - 1;
+		return sorted[std::max(0, rank)];
+	}
+
+	void Write(FILE * out, const char * name) {
+		double sum = 0;
+		for (size_t i = 0; i < ms.size(); i++) sum += ms[i];
+		fprintf(out, "\t\"%s\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f }",
+			name, sum / ms.size(), Percentile(50), Percentile(95), Percentile(99), Percentile(100));
+	}
+};
+
+// The first frames warm up caches and drivers and are not recorded.
+// Every frame is finished with glFinish, so frame time is the latency from onIdle to the completed image,
+// submission is the CPU time of onIdle and onDisplay, and the GPU time is measured by a timer query.
+int RunFrameBenchmark(const char * program, const char * scene) {
+	FrameStatistics frame, submission, gpu;
+	unsigned int query;
+	glGenQueries(1, &query);
+	const int warmUp = 10;
+	long allocations = 0, sizes[ALLOCATION_SIZE_CLASSES];
+	frame.ms.reserve(benchmarkFrames);		// the statistics do not allocate in the measured frames
+	submission.ms.reserve(benchmarkFrames);
+	gpu.ms.reserve(benchmarkFrames);
+	for (int i = 0; i < warmUp + benchmarkFrames; i++) {
+		if (i == warmUp) {
+			frameAllocations.Restart();
+			allocations = allocationCount;
+			for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) sizes[c] = allocationSizes[c];
+		}
+		benchmarkTime = i * NANOSECONDS_PER_SECOND / 60;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		onIdle();
+		onDisplay();
+		glEndQuery(GL_TIME_ELAPSED);
+		std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+		glFinish();
+		std::chrono::steady_clock::time_point finished = std::chrono::steady_clock::now();
+		GLuint64 gpuNanoseconds = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuNanoseconds);
+		if (i < warmUp) continue;
+		submission.ms.push_back(std::chrono::duration<double, std::milli>(submitted - start).count());
+		frame.ms.push_back(std::chrono::duration<double, std::milli>(finished - start).count());
+		gpu.ms.push_back(gpuNanoseconds / 1e6);
+	}
+	allocations = allocationCount - allocations;
+	for (int c = 0; c < ALLOCATION_SIZE_CLASSES; c++) sizes[c] = allocationSizes[c] - sizes[c];
+	glDeleteQueries(1, &query);
+	capture.Finish(true);
+
+	FILE * out = benchmarkFile ? fopen(benchmarkFile, "w") : stdout;
+	if (!out) {
+		printf("Cannot open %s\n", benchmarkFile);
+		return 1;
+	}
+	fprintf(out, "{\n\t\"program\": \"%s\",\n\t\"renderer\": \"%s\",\n\t\"scene\": { %s },\n\t\"frames\": %d,\n",
+		program, (const char *)glGetString(GL_RENDERER), scene, benchmarkFrames);
+	fprintf(out, "\t\"allocations_per_frame\": %.2f,\n\t\"allocating_frames\": %ld,\n\t\"max_allocations_per_frame\": %ld,\n",
+		(double)allocations / benchmarkFrames, frameAllocations.allocatingFrames, frameAllocations.maxPerFrame);
+	WriteAllocationSizes(out, "allocation_sizes", sizes);
+	WriteAllocationSizes(out, "max_frame_allocation_sizes", frameAllocations.maxFrameSizes);
+	if (resolution.Active())
+		fprintf(out, "\t\"resolution_scale\": %.3f,\n\t\"resolution_changes\": %ld,\n", resolution.Scale(), resolution.Changes());
+	fprintf(out, "\t\"static_layer_renders\": %ld,\n", staticLayer.Renders());
+	frame.Write(out, "frame_ms");
+	fprintf(out, ",\n");
+	submission.Write(out, "submission_ms");
+	fprintf(out, ",\n");
+	gpu.Write(out, "gpu_ms");
+	fprintf(out, "\n}\n");
+	if (out != stdout) fclose(out);
+	return 0;
+}
+
+//---------------------------------------------------------------------------------------------
+// Microbenchmarks of the math core without a window: clifford -microbench [file.json]
+//---------------------------------------------------------------------------------------------
+volatile float benchmarkSink;	// results are written here, so the measured code is not optimized away
+
+// the math types with every scalar type they are written for, so a member that does not compile for one fails the build
+template struct CliffordT<double>;
+template struct CliffordT<Pack4>;
+template struct mat4T<double>;
+template struct mat4T<Pack4>;
+template struct vec2T<double>;
+template struct vec2T<Pack4>;
+template struct vec4T<double>;
+template struct vec4T<Pack4>;
+
+// distance of a point from its double precision reference, relative to the length of the reference
+float RelativeError(const vec2T<double>& exact, double x, double y) {
+	return (float)(sqrt((x - exact.x) * (x - exact.x) + (y - exact.y) * (y - exact.y)) / sqrt(exact.x * exact.x + exact.y * exact.y));
+}
+
+struct MicroBenchmark {
+	FILE * out;
+	bool first;
+
+	MicroBenchmark(FILE * out0) { out = out0; first = true; }
+
+	// runs body (n operations) repeatedly for at least 50 msec and reports one JSON record
+	template<class F> void Run(const char * name, int n, F body) {
+		body();		// warm up caches and lazily allocated buffers
+		long allocations = allocationCount;
+		long repeats = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		double elapsed;
+		do {
+			body();
+			repeats++;
+			elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		} while (elapsed < 0.05);
+		double ops = (double)repeats * n;
+		fprintf(out, "%s\n\t\t{ \"name\": \"%s\", \"size\": %d, \"ns_per_op\": %.3f, \"ops_per_sec\": %.0f, \"allocations_per_op\": %.6f }",
+			first ? "" : ",", name, n, elapsed * 1e9 / ops, ops / elapsed, (allocationCount - allocations) / ops);
+		first = false;
+	}
+
+	// reports one JSON record of an accuracy check instead of a timing
+	void Check(const char * name, int n, float maxRelativeError) {
+		fprintf(out, "%s\n\t\t{ \"name\": \"%s\", \"size\": %d, \"max_relative_error\": %g }", first ? "" : ",", name, n, maxRelativeError);
+		first = false;
+	}
+};
+
+// the Clifford of the original program with operators on values, the baseline of the expression templates
+struct ValueClifford {
+	float f, d;
+	ValueClifford(float f0 = 0, float d0 = 0) { f = f0, d = d0; }
+	ValueClifford operator+(ValueClifford r) { return ValueClifford(f + r.f, d + r.d); }
+	ValueClifford operator-(ValueClifford r) { return ValueClifford(f - r.f, d - r.d); }
+	ValueClifford operator*(ValueClifford r) { return ValueClifford(f * r.f, f * r.d + d * r.f); }
+	ValueClifford operator/(ValueClifford r) {
+		float l = r.f * r.f;
+		return (*this) * ValueClifford(r.f / l, -r.d / l);
+	}
+
+	ValueClifford static Sin(float t) { return ValueClifford(sin(t), cos(t)); }
+	ValueClifford static Cos(float t) { return ValueClifford(cos(t), -sin(t)); }
+};
+
+int RunMicroBenchmarks(const char * fileName) {
+	FILE * out = fileName ? fopen(fileName, "w") : stdout;
+	if (!out) {
+		printf("Cannot open %s\n", fileName);
+		return 1;
+	}
+	fprintf(out, "{\n\t\"program\": \"clifford\",\n\t\"benchmarks\": [");
+	MicroBenchmark bench(out);
+	PathProgram rational;
+	rational.Compile("x = sin(t)*(sin(t)+3)*3/(sin(t)+2); y = (cos(t)*4+1)/(sin(t)+2)");
+
+	const int sizes[] = { 1024, 65536, 1048576 };
+	for (int s = 0; s < 3; s++) {
+		int n = sizes[s];
+		std::vector<float> t(n), xf(n), xd(n), yf(n), yd(n);
+		for (int i = 0; i < n; i++) t[i] = 0.001f * i;
+		std::vector<Clifford> a(n), b(n), c(n);
+		CliffordSinCos(&t[0], n, &a[0], &b[0]);
+
+		bench.Run("Clifford arithmetic", n, [&]() {
+			for (int i = 0; i < n; i++) c[i] = a[i] * (a[i] + 3) * 3 / (b[i] + 2);
+			benchmarkSink = c[n - 1].f;
+		});
+		std::vector<ValueClifford> va(n), vb(n), vc(n);
+		for (int i = 0; i < n; i++) { va[i] = ValueClifford(a[i].f, a[i].d); vb[i] = ValueClifford(b[i].f, b[i].d); }
+		bench.Run("Clifford arithmetic, by-value struct", n, [&]() {
+			for (int i = 0; i < n; i++) vc[i] = va[i] * (va[i] + 3) * 3 / (vb[i] + 2);
+			benchmarkSink = vc[n - 1].f;
+		});
+		bench.Run("Clifford::Sin", n, [&]() {
+			for (int i = 0; i < n; i++) c[i] = Clifford::Sin(t[i]);
+			benchmarkSink = c[n - 1].f;
+		});
+		bench.Run("CliffordSinCos batch", n, [&]() {
+			CliffordSinCos(&t[0], n, &a[0], &b[0]);
+			benchmarkSink = a[n - 1].f;
+		});
+		bench.Run("Path", n, [&]() {
+			for (int i = 0; i < n; i++) Path(t[i], a[i], b[i]);
+			benchmarkSink = a[n - 1].f;
+		});
+		bench.Run("Path rational, expression templates", n, [&]() {
+			for (int i = 0; i < n; i++) {
+				SinCos sc(t[i]);
+				a[i] = sc.sin * (sc.sin + 3) * 3 / (sc.sin + 2);
+				b[i] = (sc.cos * 4 + 1) / (sc.sin + 2);
+			}
+			benchmarkSink = a[n - 1].f;
+		});
+		bench.Run("Path rational, expression templates, batch sine", n, [&]() {	// the sines with the vectorized kernel first
+			const int CHUNK = 64;
+			float s[CHUNK], co[CHUNK];
+			for (int base = 0; base < n; base += CHUNK) {
+				int m = std::min(CHUNK, n - base);
+				FastSinCos(&t[base], s, co, m);
+				for (int k = 0; k < m; k++) {
+					Clifford sin(s[k], co[k]), cos(co[k], -s[k]);
+					a[base + k] = sin * (sin + 3) * 3 / (sin + 2);
+					b[base + k] = (cos * 4 + 1) / (sin + 2);
+				}
+			}
+			benchmarkSink = a[n - 1].f;
+		});
+		bench.Run("Path rational, by-value struct", n, [&]() {		// with one sine and cosine like SinCos
+			for (int i = 0; i < n; i++) {
+				float s, co;
+				FastSinCos(t[i], s, co);
+				ValueClifford sin(s, co), cos(co, -s);
+				ValueClifford x = sin * (sin + 3) * 3 / (sin + 2), y = (cos * 4 + 1) / (sin + 2);
+				a[i] = Clifford(x.f, x.d);
+				b[i] = Clifford(y.f, y.d);
+			}
+			benchmarkSink = a[n - 1].f;
+		});
+		bench.Run("Path rational, original program", n, [&]() {	// libm sine and cosine of every Sin and Cos
+			for (int i = 0; i < n; i++) {
+				ValueClifford x = ValueClifford::Sin(t[i]) * (ValueClifford::Sin(t[i]) + 3) * 3 / (ValueClifford::Sin(t[i]) + 2);
+				ValueClifford y = (ValueClifford::Cos(t[i]) * 4 + 1) / (ValueClifford::Sin(t[i]) + 2);
+				a[i] = Clifford(x.f, x.d);
+				b[i] = Clifford(y.f, y.d);
+			}
+			benchmarkSink = a[n - 1].f;
+		});
+		bench.Run("Path rational, path program", n, [&]() {
+			rational.Eval(&t[0], n, &xf[0], &xd[0], &yf[0], &yd[0]);
+			benchmarkSink = xf[n - 1];
+		});
+
+		std::vector<mat4> m(n);
+		for (int i = 0; i < n; i++) m[i] = camera.V() * camera.P();
+		bench.Run("mat4::operator*", n, [&]() {
+			for (int i = 1; i < n; i++) m[i] = m[i - 1] * m[i];
+			benchmarkSink = m.back().m[3][3];
+		});
+	}
+
+	// the rational path in Pack4, four parameters at a time, and the errors of the float and Pack4 points and
+	// tangents against double
+	const int n = 65536;
+	std::vector<float> t(n);
+	for (int i = 0; i < n; i++) t[i] = 0.001f * i;
+	std::vector<CliffordT<Pack4> > x4(n / 4), y4(n / 4);
+	bench.Run("Path rational, Pack4", n, [&]() {
+		for (int i = 0; i < n / 4; i++) {
+			SinCosT<Pack4> sc(Pack4(t[4 * i], t[4 * i + 1], t[4 * i + 2], t[4 * i + 3]));
+			x4[i] = sc.sin * (sc.sin + 3) * 3 / (sc.sin + 2);
+			y4[i] = (sc.cos * 4 + 1) / (sc.sin + 2);
+		}
+		benchmarkSink = x4[n / 4 - 1].f.v[3];
+	});
+	float floatError = 0, packError = 0;
+	for (int i = 0; i < n; i++) {
+		SinCosT<double> exact(t[i]);
+		CliffordT<double> x = exact.sin * (exact.sin + 3) * 3 / (exact.sin + 2), y = (exact.cos * 4 + 1) / (exact.sin + 2);
+		vec2T<double> point(x.f, y.f), tangent(x.d, y.d);
+		SinCos sc(t[i]);
+		Clifford xf = sc.sin * (sc.sin + 3) * 3 / (sc.sin + 2), yf = (sc.cos * 4 + 1) / (sc.sin + 2);
+		floatError = std::max(floatError, std::max(RelativeError(point, xf.f, yf.f), RelativeError(tangent, xf.d, yf.d)));
+		const CliffordT<Pack4>& xp = x4[i / 4], & yp = y4[i / 4];
+		int lane = i % 4;
+		packError = std::max(packError,
+			std::max(RelativeError(point, xp.f.v[lane], yp.f.v[lane]), RelativeError(tangent, xp.d.v[lane], yp.d.v[lane])));
+	}
+	bench.Check("Path rational, float - double", n, floatError);
+	bench.Check("Path rational, Pack4 - double", n, packError);
+
+	// gradient of the spline fit error by hundreds of control point coordinates, checked against finite differences
+	std::vector<vec2> samples;
+	SampleCurve(rational, 8 * 256, samples);
+	std::vector<float> px(256), py(256), gradient;
+	for (int j = 0; j < 256; j++) {		// control points off the path, so the gradient is not close to 0
+		px[j] = samples[8 * j].x * (1 + 0.1f * sinf(j * 0.7f));
+		py[j] = samples[8 * j].y * (1 + 0.1f * cosf(j * 1.3f));
+	}
+	bench.Run("Spline fit gradient, reverse mode", 2 * 256, [&]() {
+		benchmarkSink = SplineFitGradient(px, py, samples, gradient);
+	});
+	bench.Check("Spline fit gradient - finite differences", 2 * 256, SplineFitGradientCheck(px, py, samples));
+	fprintf(out, "\n\t]\n}\n");
+	if (out != stdout) fclose(out);
+	return 0;
+}
+
+// after onInitialization: the replay and the frame benchmark end the program here, the interactive run goes on
+void StartRun() {
+	if (!sceneFiles.empty()) LoadScene(sceneFiles[0]);
+	if ((frameTimeBudget > 0 || fixedResolution > 0) && !resolution.Start(windowWidth, windowHeight, frameTimeBudget, fixedResolution))
+		exit(1);
+	if (captureFile && !capture.Start(captureFile, windowWidth, windowHeight)) exit(1);
+	if (inputLog.Replaying()) exit(RunReplay());
+
+	if (benchmarkFrames > 0) {
+		char scene[256];
+		sprintf(scene, "\"vehicles\": %d, \"paths\": %d, \"path_points\": %d", nVehicles, nPaths, nPathPoints);
+		exit(RunFrameBenchmark("clifford", scene));
+	}
+#if !defined(__APPLE__)
+	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);	// so that onExit is called
+#endif
+}
+
+// options of glutInit and the number of their arguments, -1 if the option is not one of them
+int GlutOptionArguments(const char * option) {
+	if (strcmp(option, "-display") == 0) return 1;
+	const char * flags[] = { "-direct", "-indirect", "-iconic", "-gldebug", "-sync" };
+	for (int i = 0; i < 5; i++) if (strcmp(option, flags[i]) == 0) return 0;
+	return -1;
+}
+
+int fitControlPoints = 0;	// control points of the path fitted to the current path, 0: no fit
+
+// one path program per line, the empty lines are skipped
+bool LoadPathPrograms(const char * fileName) {
+	FILE * file = fopen(fileName, "r");
+	if (!file) {
+		printf("Cannot open path program file %s\n", fileName);
+		return false;
+	}
+	char line[4096];
+	int count = 0, instructions = 0;
+	for (int lineNumber = 1; fgets(line, sizeof(line), file); lineNumber++) {
+		if (strspn(line, " \t\r\n") == strlen(line)) continue;
+		PathProgram * pathProgram = new PathProgram();
+		line[strcspn(line, "\r\n")] = '\0';	// statements of a program are separated by ;
+		if (!pathProgram->Compile(line)) {
+			printf("in line %d of %s\n", lineNumber, fileName);
+			delete pathProgram;
+			fclose(file);
+			return false;
+		}
+		instructions += pathProgram->Size();
+		userPaths.push_back(pathProgram);
+		count++;
+	}
+	fclose(file);
+	printf("Path programs: %d programs, %d instructions\n", count, instructions);
+	return count > 0;
+}
+
+// The options are read before glutInit, which gets the same arguments and takes its own options from them:
+//   -microbench [file.json]                  microbenchmarks of the math core without a window, must be the first
+//   -vehicles n                              number of simulated vehicles
+//   -paths n                                 number of simulated paths, copies of the path scaled by 1/n, 2/n .. 1
+//   -points n                                number of points of the drawn path
+//   -linewidth pixels                        width of the anti-aliased lines, 0: 1 pixel line loops
+//   -benchmark frames [-json file]           frame benchmark instead of the interactive run
+//   -capture name.ppm | name.rgba            capture the frames into images or a raw video stream
+//   -frametime ms | -resolution scale        dynamic resolution within a GPU time budget, or a fixed one
+//   -nolayercache                            draw the path or the scene every frame
+//   -record file | -replay file              record the input events, or replay them without a window loop
+//   -scene file                              binary scene instead of the built-in one, repeat to switch with 1..9
+//   -savescene file                          save a scene of -paths circles and -vehicles vehicles and exit
+//   -catmullrom | -bezier | -bspline file    spline path with control points from a file
+//   -fit n                                   replace the path with a Catmull-Rom path of n control points fitted to it
+//   -programs file                           path programs, one per line, each is a simulated path
+//   anything else                            path program, the first one is drawn, more of them are simulated paths
+void ParseOptions(int argc, char * argv[]) {
+	if (argc > 1 && std::string(argv[1]) == "-microbench") exit(RunMicroBenchmarks(argc > 2 ? argv[2] : NULL));
+
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		int glutArguments = GlutOptionArguments(argv[i]);
+		if (glutArguments >= 0) {
+			i += glutArguments;		// left for glutInit
+		} else if (option == "-vehicles" && i + 1 < argc) {
+			nVehicles = atoi(argv[++i]);
+		} else if (option == "-paths" && i + 1 < argc) {
+			nPaths = std::max(1, atoi(argv[++i]));
+		} else if (option == "-points" && i + 1 < argc) {
+			nPathPoints = atoi(argv[++i]);
+		} else if (option == "-fit" && i + 1 < argc) {
+			fitControlPoints = atoi(argv[++i]);
+		} else if (option == "-linewidth" && i + 1 < argc) {
+			lineWidth = std::max(0.0f, (float)atof(argv[++i]));
+		} else if (option == "-benchmark" && i + 1 < argc) {
+			benchmarkFrames = atoi(argv[++i]);
+		} else if (option == "-json" && i + 1 < argc) {
+			benchmarkFile = argv[++i];
+		} else if (option == "-capture" && i + 1 < argc) {
+			captureFile = argv[++i];
+		} else if (option == "-nolayercache") {
+			staticLayer.Disable();
+		} else if (option == "-frametime" && i + 1 < argc) {
+			frameTimeBudget = atof(argv[++i]);
+		} else if (option == "-resolution" && i + 1 < argc) {
+			fixedResolution = (float)atof(argv[++i]);
+		} else if ((option == "-record" || option == "-replay") && i + 1 < argc) {
+			if (!inputLog.Open(argv[++i], option == "-replay")) exit(1);
+		} else if (option == "-scene" && i + 1 < argc) {
+			sceneFiles.push_back(argv[++i]);
+		} else if (option == "-savescene" && i + 1 < argc) {
+			exit(SaveScene(argv[++i], nPaths, nPathPoints > 0 ? nPathPoints : 64, nVehicles) ? 0 : 1);
+		} else if ((option == "-catmullrom" || option == "-bezier" || option == "-bspline") && i + 1 < argc) {
+			std::vector<vec2> cps;
+			if (!LoadControlPoints(argv[++i], cps)) exit(1);
+			SplinePath * spline;
+			if (option == "-catmullrom") spline = new CatmullRomPath(cps);
+			else if (option == "-bezier") spline = new BezierPath(cps);
+			else spline = new BSplinePath(cps);
+			printf("Spline path: %d segments\n", spline->Segments());
+			userPaths.push_back(spline);
+		} else if (option == "-programs" && i + 1 < argc) {
+			if (!LoadPathPrograms(argv[++i])) exit(1);
+		} else {
+			PathProgram * pathProgram = new PathProgram();
+			if (!pathProgram->Compile(argv[i])) exit(1);
+			printf("Path program: %d instructions\n", pathProgram->Size());
+			userPaths.push_back(pathProgram);
+		}
+	}
+	if (fitControlPoints >= 4) {		// the fitted path replaces the current one
+		Curve * fitted = FitPath(*CurrentPath(), fitControlPoints);
+		if (userPaths.empty()) userPaths.push_back(fitted);
+		else {
+			delete userPaths[0];
+			userPaths[0] = fitted;
+		}
+	}
+	if (userPaths.size() > 1) nPaths = userPaths.size();
+}
+
 int main(int argc, char * argv[]) {
+	ParseOptions(argc, argv);					// runs without a window exit here
 	glutInit(&argc, argv);
 #if !defined(__APPLE__)
 	glutInitContextVersion(majorVersion, minorVersion);